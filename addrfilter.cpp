@@ -0,0 +1,42 @@
+#include <random>
+
+#include "addrfilter.h"
+#include "siphash.h"
+
+using namespace std;
+
+CAddrFilter::CAddrFilter() {
+  std::random_device rd;
+  k0 = ((uint64_t)rd() << 32) ^ rd();
+  k1 = ((uint64_t)rd() << 32) ^ rd();
+}
+
+uint64_t CAddrFilter::GetKey(const CService &ip) const {
+  unsigned char vchKey[18];
+  ip.GetKey(vchKey);
+  return SipHash(k0, k1, vchKey, sizeof(vchKey));
+}
+
+void CAddrFilter::Set(const CService &ip, int64 nTime) {
+  uint64_t nKey = GetKey(ip);
+  CShard &shard = vShard[nKey % SHARDS];
+  CRITICAL_BLOCK(shard.cs)
+    shard.mapTime[nKey] = nTime;
+}
+
+void CAddrFilter::Erase(const CService &ip) {
+  uint64_t nKey = GetKey(ip);
+  CShard &shard = vShard[nKey % SHARDS];
+  CRITICAL_BLOCK(shard.cs)
+    shard.mapTime.erase(nKey);
+}
+
+bool CAddrFilter::IsKnown(const CService &ip, int64 nTime) {
+  uint64_t nKey = GetKey(ip);
+  CShard &shard = vShard[nKey % SHARDS];
+  CRITICAL_BLOCK(shard.cs) {
+    unordered_map<uint64_t, int64>::const_iterator it = shard.mapTime.find(nKey);
+    return it != shard.mapTime.end() && nTime <= it->second;
+  }
+  return false;
+}
@@ -0,0 +1,43 @@
+#ifndef _ADDRFILTER_H_
+#define _ADDRFILTER_H_ 1
+
+#include <stdint.h>
+
+#include <unordered_map>
+
+#include "netbase.h"
+#include "util.h"
+
+// For every address CAddrDb knows or has banned, the newest nTime with
+// which an addr message about it would make no difference: its lastTry,
+// or the end of its ban. Crawlers check their addr batches against this
+// before they take the database lock, as almost all of them are known
+// already. The shards have locks of their own, held only for a lookup.
+//
+// Entries are keyed by a 64-bit SipHash of the address, under a random
+// key; a collision only drops an addr message about one of the two.
+class CAddrFilter {
+private:
+  static const int SHARDS = 64;
+
+  struct CShard {
+    CCriticalSection cs;
+    std::unordered_map<uint64_t, int64> mapTime;
+  };
+
+  CShard vShard[SHARDS];
+  uint64_t k0, k1;   // SipHash key
+
+  uint64_t GetKey(const CService &ip) const;
+
+public:
+  CAddrFilter();
+
+  void Set(const CService &ip, int64 nTime);
+  void Erase(const CService &ip);
+
+  // whether an addr message about ip with time nTime can be skipped
+  bool IsKnown(const CService &ip, int64 nTime);
+};
+
+#endif
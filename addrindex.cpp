@@ -0,0 +1,84 @@
+#include <string.h>
+
+#include <random>
+
+#include "addrindex.h"
+#include "siphash.h"
+
+using namespace std;
+
+CAddrIndex::CAddrIndex() : nCount(0) {
+  std::random_device rd;
+  k0 = ((uint64_t)rd() << 32) ^ rd();
+  k1 = ((uint64_t)rd() << 32) ^ rd();
+  clear();
+}
+
+size_t CAddrIndex::GetHome(const unsigned char *pchKey) const {
+  return SipHash(k0, k1, pchKey, KEY_SIZE) & (vEntry.size() - 1);
+}
+
+size_t CAddrIndex::FindSlot(const unsigned char *pchKey) const {
+  size_t nMask = vEntry.size() - 1;
+  size_t i = GetHome(pchKey);
+  while (vEntry[i].id != -1 && memcmp(vEntry[i].vchKey, pchKey, KEY_SIZE) != 0)
+    i = (i + 1) & nMask;
+  return i;
+}
+
+void CAddrIndex::Resize(size_t nSlots) {
+  vector<CEntry> vOld;
+  vOld.swap(vEntry);
+  CEntry empty = {};
+  empty.id = -1;
+  vEntry.assign(nSlots, empty);
+  for (size_t i = 0; i < vOld.size(); i++) {
+    if (vOld[i].id != -1)
+      vEntry[FindSlot(vOld[i].vchKey)] = vOld[i];
+  }
+}
+
+int CAddrIndex::Find(const CService &ip) const {
+  unsigned char vchKey[KEY_SIZE];
+  ip.GetKey(vchKey);
+  return vEntry[FindSlot(vchKey)].id;
+}
+
+void CAddrIndex::Set(const CService &ip, int id) {
+  if (2 * (nCount + 1) > vEntry.size())
+    Resize(vEntry.size() * 2);
+  unsigned char vchKey[KEY_SIZE];
+  ip.GetKey(vchKey);
+  CEntry &entry = vEntry[FindSlot(vchKey)];
+  if (entry.id == -1) {
+    memcpy(entry.vchKey, vchKey, KEY_SIZE);
+    nCount++;
+  }
+  entry.id = id;
+}
+
+void CAddrIndex::erase(const CService &ip) {
+  unsigned char vchKey[KEY_SIZE];
+  ip.GetKey(vchKey);
+  size_t nMask = vEntry.size() - 1;
+  size_t i = FindSlot(vchKey);
+  if (vEntry[i].id == -1) return;
+  // move back each following entry of the run that the hole would cut off
+  // from its home slot
+  for (size_t j = (i + 1) & nMask; vEntry[j].id != -1; j = (j + 1) & nMask) {
+    size_t nHome = GetHome(vEntry[j].vchKey);
+    if (((j - nHome) & nMask) >= ((j - i) & nMask)) {
+      vEntry[i] = vEntry[j];
+      i = j;
+    }
+  }
+  vEntry[i].id = -1;
+  nCount--;
+}
+
+void CAddrIndex::clear() {
+  CEntry empty = {};
+  empty.id = -1;
+  vEntry.assign(MIN_SLOTS, empty);
+  nCount = 0;
+}
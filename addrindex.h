@@ -0,0 +1,49 @@
+#ifndef _ADDRINDEX_H_
+#define _ADDRINDEX_H_ 1
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "netbase.h"
+
+// Map from CService to a non-negative int id, as a flat open-addressing
+// table with linear probing. Entries hold the packed 18-byte address and
+// port themselves, so a lookup hashes once (SipHash, under a random key)
+// and usually compares a single entry. The table doubles once it is half
+// full, and erasing shifts the entries after it back instead of leaving
+// tombstones.
+class CAddrIndex {
+private:
+  static const int KEY_SIZE = 18;
+  static const size_t MIN_SLOTS = 1024;
+
+  struct CEntry {
+    unsigned char vchKey[KEY_SIZE];
+    int id; // -1 for an empty slot
+  };
+
+  std::vector<CEntry> vEntry;
+  size_t nCount;
+  uint64_t k0, k1;
+
+  size_t GetHome(const unsigned char *pchKey) const;
+  size_t FindSlot(const unsigned char *pchKey) const; // its slot, or the empty one where it would go
+  void Resize(size_t nSlots);
+
+public:
+  CAddrIndex();
+
+  size_t size() const { return nCount; }
+
+  // the id of ip, or -1
+  int Find(const CService &ip) const;
+  bool count(const CService &ip) const { return Find(ip) != -1; }
+
+  // set the id of ip, which must be non-negative
+  void Set(const CService &ip, int id);
+  void erase(const CService &ip);
+  void clear();
+};
+
+#endif
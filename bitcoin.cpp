@@ -1,19 +1,32 @@
 #include <algorithm>
+#include <random>
+#include <poll.h>
+#include <sys/epoll.h>
 
+#include "bitcoin.h"
 #include "db.h"
+#include "latency.h"
 #include "netbase.h"
 #include "protocol.h"
 #include "serialize.h"
+#include "sha256.h"
 #include "uint256.h"
+#include "uring.h"
 
 #define BITCOIN_SEED_NONCE  0x0539a019ca550825ULL
+#define KEEPALIVE_VERSION   70001 // nonce pings (BIP31), and fRelay honoured
+#define KEEPALIVE_SWEEP     60    // seconds between looks for expired connections
+
+CKeepAlivePool keepalive;
 
 using namespace std;
 
 class CNode {
   SOCKET sock;
-  CDataStream vSend;
-  CDataStream vRecv;
+  CNetDataStream vSend;
+  vector<char, pool_allocator<char> > vRecv; // receive buffer; bytes before nRecvPos are consumed
+  unsigned int nRecvPos;
+  int nRecvVersion;
   unsigned int nHeaderStart;
   unsigned int nMessageStart;
   int nVersion;
@@ -22,6 +35,14 @@ class CNode {
   vector<CAddress> *vAddr;
   int ban;
   int64 doneAfter;
+  int nConnectError;
+  bool fClosed;       // the connection broke, rather than went quiet
+  bool fPipeline;     // send verack and getaddr along with our version
+  bool fSentVerack;
+  bool fSentGetaddr;
+  uint64 nPingNonce;  // of our outstanding ping, or 0
+  int64 nSentMillis;  // when our version or ping went out, until answered
+  int nReplyTimeout;  // in seconds
   CAddress you;
 
   int GetTimeout() {
@@ -31,6 +52,21 @@ class CNode {
           return 30;
   }
 
+  // we sent something the peer should answer quickly; wait for it about as
+  // long as peers like it take, instead of the full timeout
+  void ExpectReply() {
+    nSentMillis = GetTimeMillis();
+    // deadlines are checked in whole seconds, so leave one of slack
+    int64 nMillis = latency.GetTimeout(you, LATENCY_REPLY, GetTimeout() * 1000);
+    nReplyTimeout = std::min((int)((nMillis + 999) / 1000) + 1, GetTimeout());
+  }
+
+  void GotReply() {
+    if (!nSentMillis) return;
+    latency.Record(you, LATENCY_REPLY, GetTimeMillis() - nSentMillis);
+    nSentMillis = 0;
+  }
+
   void BeginMessage(const char *pszCommand) {
     if (nHeaderStart != -1) AbortMessage();
     nHeaderStart = vSend.size();
@@ -61,18 +97,6 @@ class CNode {
     nMessageStart = -1;
   }
   
-  void Send() {
-    if (sock == INVALID_SOCKET) return;
-    if (vSend.empty()) return;
-    int nBytes = send(sock, &vSend[0], vSend.size(), 0);
-    if (nBytes > 0) {
-      vSend.erase(vSend.begin(), vSend.begin() + nBytes);
-    } else {
-      close(sock);
-      sock = INVALID_SOCKET;
-    }
-  }
-  
   void PushVersion() {
     int64 nTime = time(NULL);
     uint64 nLocalNonce = BITCOIN_SEED_NONCE;
@@ -82,22 +106,38 @@ class CNode {
     int nBestHeight = GetRequireHeight();
     string ver = "/bitcoin-seeder:0.01/";
     uint8_t fRelayTxs = 0;
-    vSend << PROTOCOL_VERSION << nLocalServices << nTime << you << me << nLocalNonce << ver << nBestHeight << fRelayTxs;
+    // kept connections need pongs that match our pings
+    int nVersionOut = keepalive.IsEnabled() ? KEEPALIVE_VERSION : PROTOCOL_VERSION;
+    vSend << nVersionOut << nLocalServices << nTime << you << me << nLocalNonce << ver << nBestHeight << fRelayTxs;
     EndMessage();
+    if (fPipeline) {
+      // saves a round trip; only safe for peers known to accept messages
+      // that arrive before their own version reached us
+      BeginMessage("verack");
+      EndMessage();
+      fSentVerack = true;
+      PushGetaddr();
+    }
+  }
+
+  void PushGetaddr() {
+    if (!vAddr || fSentGetaddr) return;
+    BeginMessage("getaddr");
+    EndMessage();
+    fSentGetaddr = true;
   }
  
   void GotVersion() {
     // printf("\n%s: version %i\n", ToString(you).c_str(), nVersion);
     if (vAddr) {
-      BeginMessage("getaddr");
-      EndMessage();
+      PushGetaddr();
       doneAfter = time(NULL) + GetTimeout();
     } else {
       doneAfter = time(NULL) + 1;
     }
   }
 
-  bool ProcessMessage(string strCommand, CDataStream& vRecv) {
+  bool ProcessMessage(string strCommand, CDataView& vRecv) {
 //    printf("%s: RECV %s\n", ToString(you).c_str(), strCommand.c_str());
     if (strCommand == "version") {
       int64 nTime;
@@ -105,6 +145,7 @@ class CNode {
       CAddress addrFrom;
       uint64 nNonce = 1;
       vRecv >> nVersion >> you.nServices >> nTime >> addrMe;
+      GotReply();
       if (nVersion == 10300) nVersion = 300;
       if (nVersion >= 106 && !vRecv.empty())
         vRecv >> addrFrom >> nNonce;
@@ -113,43 +154,65 @@ class CNode {
       if (nVersion >= 209 && !vRecv.empty())
         vRecv >> nStartingHeight;
       
-      if (nVersion >= 209) {
+      if (nVersion >= 209 && !fSentVerack) {
         BeginMessage("verack");
         EndMessage();
+        fSentVerack = true;
       }
       vSend.SetVersion(min(nVersion, PROTOCOL_VERSION));
       if (nVersion < 209) {
-        this->vRecv.SetVersion(min(nVersion, PROTOCOL_VERSION));
+        nRecvVersion = min(nVersion, PROTOCOL_VERSION);
         GotVersion();
       }
       return false;
     }
     
     if (strCommand == "verack") {
-      this->vRecv.SetVersion(min(nVersion, PROTOCOL_VERSION));
+      nRecvVersion = min(nVersion, PROTOCOL_VERSION);
       GotVersion();
       return false;
     }
     
+    if (strCommand == "ping") {
+      if (nVersion > 60000) {
+        uint64 nNonce = 0;
+        vRecv >> nNonce;
+        BeginMessage("pong");
+        vSend << nNonce;
+        EndMessage();
+      }
+      return false;
+    }
+
+    if (strCommand == "pong") {
+      uint64 nNonce = 0;
+      vRecv >> nNonce;
+      if (nPingNonce && nNonce == nPingNonce) {
+        GotReply();
+        nPingNonce = 0;
+        doneAfter = time(NULL);
+      }
+      return false;
+    }
+
     if (strCommand == "addr" && vAddr) {
-      vector<CAddress> vAddrNew;
-      vRecv >> vAddrNew;
-      // printf("%s: got %i addresses\n", ToString(you).c_str(), (int)vAddrNew.size());
       int64 now = time(NULL);
-      vector<CAddress>::iterator it = vAddrNew.begin();
-      if (vAddrNew.size() > 1) {
-        if (doneAfter == 0 || doneAfter > now + 1) doneAfter = now + 1;
-      }
-      while (it != vAddrNew.end()) {
-        CAddress &addr = *it;
+      bool fFull = false;
+      // filter entries as they are decoded, straight into vAddr
+      uint64 nAddr = UnserializeEach<CAddress>(vRecv, [&](CAddress &addr) {
 //        printf("%s: got address %s\n", ToString(you).c_str(), addr.ToString().c_str(), (int)(vAddr->size()));
-        it++;
         if (addr.nTime <= 100000000 || addr.nTime > now + 600)
           addr.nTime = now - 5 * 86400;
         if (addr.nTime > now - 604800)
           vAddr->push_back(addr);
 //        printf("%s: added address %s (#%i)\n", ToString(you).c_str(), addr.ToString().c_str(), (int)(vAddr->size()));
-        if (vAddr->size() > 1000) {doneAfter = 1; return true; }
+        fFull = vAddr->size() > 1000;
+        return !fFull;
+      });
+      // printf("%s: got %i addresses\n", ToString(you).c_str(), (int)nAddr);
+      if (fFull) {doneAfter = 1; return true; }
+      if (nAddr > 1) {
+        if (doneAfter == 0 || doneAfter > now + 1) doneAfter = now + 1;
       }
       return false;
     }
@@ -157,109 +220,251 @@ class CNode {
     return false;
   }
   
+  // Whether ProcessMessage acts on this command; other messages are
+  // skipped without hashing or parsing their payload.
+  bool IsWanted(const CMessageHeader &hdr) {
+    static const char *ppszWanted[] = {"version", "verack", "addr", "ping", "pong"};
+    for (int i = 0; i < ARRAYLEN(ppszWanted); i++) {
+      if (strncmp(hdr.pchCommand, ppszWanted[i], CMessageHeader::COMMAND_SIZE) == 0)
+        return i != 2 || vAddr;
+    }
+    return false;
+  }
+
+  // Parse whole messages from vRecv in place, advancing nRecvPos past them.
+  // Checksums of all buffered messages are verified in one batch.
   bool ProcessMessages() {
-    if (vRecv.empty()) return false;
+    static const int MAX_BATCH = 32;
+    CMessageHeader vHdr[MAX_BATCH];
+    const unsigned char *vpMsg[MAX_BATCH];
+    size_t vnMsg[MAX_BATCH];
+    unsigned char vHash[MAX_BATCH * 32];
     do {
-      CDataStream::iterator pstart = search(vRecv.begin(), vRecv.end(), BEGIN(pchMessageStart), END(pchMessageStart));
-      int nHeaderSize = vRecv.GetSerializeSize(CMessageHeader());
-      if (vRecv.end() - pstart < nHeaderSize) {
-        if (vRecv.size() > nHeaderSize) {
-          vRecv.erase(vRecv.begin(), vRecv.end() - nHeaderSize);
+      unsigned int nHeaderSize = ::GetSerializeSize(CMessageHeader(), SER_NETWORK, nRecvVersion);
+      unsigned int nPos = nRecvPos;
+      int nCount = 0;
+      bool fBad = false;
+      while (nCount < MAX_BATCH) {
+        const char *pbegin = vRecv.data() + nPos;
+        const char *pend = vRecv.data() + vRecv.size();
+        const char *pstart = search(pbegin, pend, BEGIN(pchMessageStart), END(pchMessageStart));
+        if (pend - pstart < nHeaderSize) {
+          // keep what could still be the start of a header
+          if (nCount == 0 && pend - pbegin > nHeaderSize)
+            nRecvPos = vRecv.size() - nHeaderSize;
+          break;
         }
-        break;
+        CMessageHeader &hdr = vHdr[nCount];
+        CDataView(pstart, pstart + nHeaderSize, SER_NETWORK, nRecvVersion) >> hdr;
+        if (!hdr.IsValid() || hdr.nMessageSize > MAX_SIZE) {
+          // printf("%s: BAD (invalid header)\n", ToString(you).c_str());
+          fBad = true;
+          break;
+        }
+        const char *pmsg = pstart + nHeaderSize;
+        if (hdr.nMessageSize > pend - pmsg) {
+          if (nCount == 0)
+            nRecvPos = pstart - vRecv.data();
+          break;
+        }
+        nPos = pmsg + hdr.nMessageSize - vRecv.data();
+        if (!IsWanted(hdr)) {
+          // with nothing pending, the cursor can move past it right away
+          if (nCount == 0)
+            nRecvPos = nPos;
+          continue;
+        }
+        vpMsg[nCount] = (const unsigned char*)pmsg;
+        vnMsg[nCount] = hdr.nMessageSize;
+        nCount++;
       }
-      vRecv.erase(vRecv.begin(), pstart);
-      vector<char> vHeaderSave(vRecv.begin(), vRecv.begin() + nHeaderSize);
-      CMessageHeader hdr;
-      vRecv >> hdr;
-      if (!hdr.IsValid()) { 
-        // printf("%s: BAD (invalid header)\n", ToString(you).c_str());
-        ban = 100000; return true;
+      if (nRecvVersion >= 209)
+        SHA256DBatch(vHash, vpMsg, vnMsg, nCount);
+      bool fRescan = false;
+      for (int i = 0; i < nCount && !fRescan; i++) {
+        const char *pmsg = (const char*)vpMsg[i];
+        nRecvPos = pmsg - vRecv.data();
+        if (nRecvVersion >= 209 && memcmp(&vHash[32 * i], &vHdr[i].nChecksum, sizeof(vHdr[i].nChecksum))) {
+          // resynchronize from just past the bad message's header
+          fRescan = true;
+          break;
+        }
+        nRecvPos += vnMsg[i];
+        int nVersionBefore = nRecvVersion;
+        CDataView vMsg(pmsg, pmsg + vnMsg[i], SER_NETWORK, nRecvVersion);
+        if (ProcessMessage(vHdr[i].GetCommand(), vMsg))
+          return true;
+        // the header format and checksums depend on the version
+        fRescan = nRecvVersion != nVersionBefore;
+//      printf("%s: done processing %s\n", ToString(you).c_str(), vHdr[i].GetCommand().c_str());
       }
-      string strCommand = hdr.GetCommand();
-      unsigned int nMessageSize = hdr.nMessageSize;
-      if (nMessageSize > MAX_SIZE) { 
-        // printf("%s: BAD (message too large)\n", ToString(you).c_str());
+      if (fRescan) continue;
+      // skip ignored messages framed after the last wanted one
+      if (nCount > 0 && nPos > nRecvPos)
+        nRecvPos = nPos;
+      if (fBad) {
         ban = 100000;
-        return true; 
-      }
-      if (nMessageSize > vRecv.size()) {
-        vRecv.insert(vRecv.begin(), vHeaderSave.begin(), vHeaderSave.end());
-        break;
-      }
-      if (vRecv.GetVersion() >= 209) {
-        uint256 hash = Hash(vRecv.begin(), vRecv.begin() + nMessageSize);
-        unsigned int nChecksum = 0;
-        memcpy(&nChecksum, &hash, sizeof(nChecksum));
-        if (nChecksum != hdr.nChecksum) continue;
-      }
-      CDataStream vMsg(vRecv.begin(), vRecv.begin() + nMessageSize, vRecv.nType, vRecv.nVersion);
-      vRecv.ignore(nMessageSize);
-      if (ProcessMessage(strCommand, vMsg))
         return true;
-//      printf("%s: done processing %s\n", ToString(you).c_str(), strCommand.c_str());
+      }
+      if (nCount < MAX_BATCH) break;
     } while(1);
     return false;
   }
   
 public:
-  CNode(const CService& ip, vector<CAddress>* vAddrIn) : you(ip), nHeaderStart(-1), nMessageStart(-1), vAddr(vAddrIn), ban(0), doneAfter(0), nVersion(0) {
+  CNode(const CService& ip, vector<CAddress>* vAddrIn, bool fPipelineIn = false) : you(ip), sock(INVALID_SOCKET), nHeaderStart(-1), nMessageStart(-1), vAddr(vAddrIn), ban(0), doneAfter(0), nConnectError(0), fClosed(false), fPipeline(fPipelineIn), fSentVerack(false), fSentGetaddr(false), nPingNonce(0), nSentMillis(0), nVersion(0), nStartingHeight(0), nRecvPos(0), nRecvVersion(0) {
+    nReplyTimeout = GetTimeout();
     vSend.SetType(SER_NETWORK);
     vSend.SetVersion(0);
-    vRecv.SetType(SER_NETWORK);
-    vRecv.SetVersion(0);
     if (time(NULL) > 1329696000) {
       vSend.SetVersion(209);
-      vRecv.SetVersion(209);
+      nRecvVersion = 209;
     }
   }
-  bool Run() {
-    bool res = true;
-    if (!ConnectSocket(you, sock)) return false;
+
+  // Event-driven interface: the caller owns the socket readiness loop, and
+  // feeds received data in. Run() below is the blocking driver built on it.
+  // Queued messages are only written by Send(), or taken by TakeSend().
+  void Start(SOCKET hSocket) {
+    sock = hSocket;
+    ExpectReply();
     PushVersion();
+  }
+
+  bool Receive(const char *pch, int nBytes) {
+    if (nBytes <= 0) {
+      fClosed = true;
+      return false;
+    }
+    // drop consumed bytes once they are the bulk of the buffer, so the
+    // cost of compacting stays linear in the data received
+    if (nRecvPos > 0 && nRecvPos * 2 >= vRecv.size()) {
+      vRecv.erase(vRecv.begin(), vRecv.begin() + nRecvPos);
+      nRecvPos = 0;
+    }
+    vRecv.insert(vRecv.end(), pch, pch + nBytes);
+    ProcessMessages();
+    return true;
+  }
+
+  // move queued output to vch, for callers doing their own socket writes
+  void TakeSend(vector<char, pool_allocator<char> > &vch) {
+    vch.insert(vch.end(), vSend.begin(), vSend.end());
+    vSend.clear();
+  }
+
+  void Send(int nFlags = 0) {
+    if (sock == INVALID_SOCKET) return;
+    if (vSend.empty()) return;
+    int nBytes = send(sock, &vSend[0], vSend.size(), MSG_NOSIGNAL | nFlags);
+    if (nBytes > 0) {
+      vSend.erase(vSend.begin(), vSend.begin() + nBytes);
+    } else if (nBytes < 0 && (WSAGetLastError() == WSAEWOULDBLOCK || WSAGetLastError() == WSAEINTR)) {
+      // non-blocking socket with a full send buffer; try again when writable
+    } else {
+      close(sock);
+      sock = INVALID_SOCKET;
+      fClosed = true;
+    }
+  }
+
+  bool IsDone(int64 now) const {
+    return ban != 0 || (doneAfter != 0 && doneAfter <= now) || sock == INVALID_SOCKET;
+  }
+
+  // time at which the probe ends if nothing more is received
+  int64 GetDeadline(int64 nLastRecv) {
+    return doneAfter ? doneAfter : nLastRecv + nReplyTimeout;
+  }
+
+  bool WantsSend() const {
+    return sock != INVALID_SOCKET && !vSend.empty();
+  }
+
+  SOCKET GetSocket() const {
+    return sock;
+  }
+
+  // Close the connection and return whether the probe succeeded. With
+  // fKeep, a successful node stays connected for the keep-alive pool. With
+  // phSocket, the socket is handed over there instead of closed.
+  bool Finish(bool res, bool fKeep = false, SOCKET *phSocket = NULL) {
+    if (sock == INVALID_SOCKET) res = false;
+    res = res && ban == 0;
+    if (!res || !fKeep) {
+      if (phSocket)
+        *phSocket = sock;
+      else
+        close(sock);
+      sock = INVALID_SOCKET;
+    }
+    return res;
+  }
+
+  // Check an established connection again: it is as good as before if a
+  // ping of ours is answered in time.
+  void Ping() {
+    std::random_device rd;
+    do {
+      nPingNonce = ((uint64)rd() << 32) ^ rd();
+    } while (nPingNonce == 0);
+    BeginMessage("ping");
+    vSend << nPingNonce;
+    EndMessage();
+    doneAfter = 0;
+    ExpectReply();
+  }
+
+  // Turn a finished probe into an idle connection, that only answers pings.
+  void Idle() {
+    vAddr = NULL;
+    doneAfter = 0;
+  }
+
+  bool Run() {
+    SOCKET hSocket;
+    int64 nStart = GetTimeMillis();
+    if (!ConnectSocket(you, hSocket, latency.GetTimeout(you, LATENCY_CONNECT, nConnectTimeout))) {
+      nConnectError = errno;
+      return false;
+    }
+    latency.Record(you, LATENCY_CONNECT, GetTimeMillis() - nStart);
+    Start(hSocket);
+    Send();
+    return Loop();
+  }
+
+  bool Revisit() {
+    Ping();
     Send();
+    return Loop();
+  }
+
+  bool Loop() {
+    bool res = true;
     int64 now;
-    while (now = time(NULL), ban == 0 && (doneAfter == 0 || doneAfter > now) && sock != INVALID_SOCKET) {
+    while (now = time(NULL), !IsDone(now)) {
       char pchBuf[0x10000];
-      fd_set read_set, except_set;
-      FD_ZERO(&read_set);
-      FD_ZERO(&except_set);
-      FD_SET(sock,&read_set);
-      FD_SET(sock,&except_set);
-      struct timeval wa;
-      if (doneAfter) {
-        wa.tv_sec = doneAfter - now;
-        wa.tv_usec = 0;
-      } else {
-        wa.tv_sec = GetTimeout();
-        wa.tv_usec = 0;
-      }
-      int ret = select(sock+1, &read_set, NULL, &except_set, &wa);
+      // poll() rather than select(), as the keep-alive pool raises the
+      // descriptor limit beyond FD_SETSIZE
+      struct pollfd pfd;
+      pfd.fd = sock;
+      pfd.events = POLLIN;
+      pfd.revents = 0;
+      int ret = poll(&pfd, 1, (GetDeadline(now) - now) * 1000);
       if (ret != 1) {
         if (!doneAfter) res = false;
         break;
       }
       int nBytes = recv(sock, pchBuf, sizeof(pchBuf), 0);
-      int nPos = vRecv.size();
-      if (nBytes > 0) {
-        vRecv.resize(nPos + nBytes);
-        memcpy(&vRecv[nPos], pchBuf, nBytes);
-      } else if (nBytes == 0) {
+      if (!Receive(pchBuf, nBytes)) {
         // printf("%s: BAD (connection closed prematurely)\n", ToString(you).c_str());
         res = false;
         break;
-      } else {
-        // printf("%s: BAD (connection error)\n", ToString(you).c_str());
-        res = false;
-        break;
       }
-      ProcessMessages();
       Send();
     }
-    if (sock == INVALID_SOCKET) res = false;
-    close(sock);
-    sock = INVALID_SOCKET;
-    return (ban == 0) && res;
+    return res;
   }
   
   int GetBan() {
@@ -281,29 +486,626 @@ public:
   uint64_t GetServices() {
     return you.nServices;
   }
+
+  const CService &GetService() {
+    return you;
+  }
+
+  int GetConnectError() {
+    return nConnectError;
+  }
+
+  // how a failed probe failed; fFailed if the caller saw the connection break
+  int GetOutcome(bool fFailed = false) {
+    if (ban) return OUTCOME_PROTOCOL;
+    if (nConnectError) return GetConnectOutcome(nConnectError);
+    if (fClosed || fFailed) return OUTCOME_RESET;
+    return OUTCOME_SILENT;
+  }
 };
 
-bool TestNode(const CService &cip, int &ban, int &clientV, std::string &clientSV, int &blocks, vector<CAddress>* vAddr, uint64_t& services) {
+bool TestNode(const CService &cip, int &ban, int &clientV, std::string &clientSV, int &blocks, vector<CAddress>* vAddr, uint64_t& services, int &error, int &outcome, bool fPipeline, bool fKeep) {
+  error = 0;
+  outcome = OUTCOME_GOOD;
+  CNode *node = NULL;
   try {
-    CNode node(cip, vAddr);
-    bool ret = node.Run();
+    bool ret;
+    // getaddr is only answered once per connection, so that needs a new one
+    if (!vAddr && (node = keepalive.Take(cip)) != NULL) {
+      ret = node->Revisit();
+    } else {
+      node = new CNode(cip, vAddr, fPipeline);
+      ret = node->Run();
+    }
+    ret = node->Finish(ret, keepalive.IsEnabled());
     if (!ret) {
-      ban = node.GetBan();
+      ban = node->GetBan();
     } else {
       ban = 0;
     }
-    clientV = node.GetClientVersion();
-    clientSV = node.GetClientSubVersion();
-    blocks = node.GetStartingHeight();
-    services = node.GetServices();
+    clientV = node->GetClientVersion();
+    clientSV = node->GetClientSubVersion();
+    blocks = node->GetStartingHeight();
+    services = node->GetServices();
+    error = node->GetConnectError();
+    if (!ret)
+      outcome = node->GetOutcome();
 //  printf("%s: %s!!!\n", cip.ToString().c_str(), ret ? "GOOD" : "BAD");
+    if (node->GetSocket() != INVALID_SOCKET)
+      keepalive.Put(node, fKeep);
+    else
+      delete node;
     return ret;
   } catch(std::ios_base::failure& e) {
+    if (node) {
+      node->Finish(false);
+      delete node;
+    }
     ban = 0;
+    outcome = OUTCOME_RESET;
     return false;
   }
 }
 
+CKeepAlivePool::CKeepAlivePool() : epfd(-1), nMax(0), nLastSweep(0) {}
+
+void CKeepAlivePool::Init(int nMaxIn) {
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd >= 0)
+    nMax = nMaxIn;
+}
+
+int CKeepAlivePool::GetCount() {
+  int nRet = 0;
+  SHARED_CRITICAL_BLOCK(cs)
+    nRet = mapIdle.size();
+  return nRet;
+}
+
+// must hold cs; the node is deleted
+void CKeepAlivePool::Drop(CNode *node) {
+  epoll_ctl(epfd, EPOLL_CTL_DEL, node->GetSocket(), NULL);
+  mapIdle.erase(node->GetService());
+  mapIdleSince.erase(node);
+  node->Finish(false);
+  delete node;
+}
+
+CNode *CKeepAlivePool::Take(const CService &service) {
+  if (!IsEnabled()) return NULL;
+  CNode *node = NULL;
+  CRITICAL_BLOCK(cs) {
+    std::map<CService, CNode*>::iterator it = mapIdle.find(service);
+    if (it == mapIdle.end())
+      return NULL;
+    node = it->second;
+    epoll_ctl(epfd, EPOLL_CTL_DEL, node->GetSocket(), NULL);
+    mapIdle.erase(it);
+    mapIdleSince.erase(node);
+  }
+  return node;
+}
+
+void CKeepAlivePool::Put(CNode *node, bool fGood) {
+  CRITICAL_BLOCK(cs) {
+    std::map<CService, CNode*>::iterator it = mapIdle.find(node->GetService());
+    if (it != mapIdle.end())
+      Drop(it->second);
+    // without BIP31 a ping is never answered
+    if (!fGood || mapIdle.size() >= nMax || node->GetClientVersion() <= 60000) {
+      node->Finish(false);
+      delete node;
+      return;
+    }
+    node->Idle();
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.ptr = node;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, node->GetSocket(), &ev)) {
+      node->Finish(false);
+      delete node;
+      return;
+    }
+    mapIdle[node->GetService()] = node;
+    mapIdleSince[node] = time(NULL);
+  }
+}
+
+// A good node is revisited well within its tier's target; a connection
+// that is not taken for twice that belongs to a node that is no longer
+// good, or no longer scheduled at all.
+void CKeepAlivePool::Expire(int64 now) {
+  int64 nMaxIdle = 2 * nTierTarget[TIER_GOOD];
+  for (std::map<CNode*, int64>::iterator it = mapIdleSince.begin(); it != mapIdleSince.end();) {
+    CNode *node = it->first;
+    int64 nSince = it->second;
+    it++;
+    if (now - nSince > nMaxIdle)
+      Drop(node);
+  }
+}
+
+void CKeepAlivePool::Run() {
+  struct epoll_event events[256];
+  do {
+    int n = epoll_wait(epfd, events, ARRAYLEN(events), KEEPALIVE_SWEEP * 1000);
+    int64 now = time(NULL);
+    CRITICAL_BLOCK(cs) {
+      for (int i=0; i<n; i++) {
+        CNode *node = (CNode*)events[i].data.ptr;
+        // it may have been taken since epoll_wait returned
+        if (!mapIdleSince.count(node)) continue;
+        int nBytes = recv(node->GetSocket(), pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+        if (nBytes < 0 && (WSAGetLastError() == WSAEWOULDBLOCK || WSAGetLastError() == WSAEINTR))
+          continue;
+        bool fOk = false;
+        try {
+          // answers pings, and skips everything else
+          // never block on a send while holding the pool: crawler sockets
+          // are blocking, and one stalled peer would hold up Take and Put;
+          // what does not fit now goes out with the next revisit
+          fOk = node->Receive(pchBuf, nBytes);
+          node->Send(MSG_DONTWAIT);
+        } catch (std::ios_base::failure& e) {
+          fOk = false;
+        }
+        if (!fOk || node->GetBan() || node->GetSocket() == INVALID_SOCKET)
+          Drop(node);
+      }
+      if (now - nLastSweep >= KEEPALIVE_SWEEP) {
+        nLastSweep = now;
+        Expire(now);
+      }
+    }
+  } while(1);
+}
+
+struct CProbeEngine::CProbe : public CPendingConnect {
+  vector<CAddress> vAddr;
+  CNode *node;         // only allocated once connected
+  CServiceResult res;
+  bool fGetAddr;
+  bool fPipeline;
+  bool fScan;         // counted in nScanning while connecting
+  int nNet;            // crawl network, whose count it is in otherwise
+  bool fConnected;
+  bool fFailed;
+  int64 nLastRecv;
+  int64 nStartMillis;
+  int nIndex;          // position in vProbes (or vFinished)
+  unsigned int nEvents;
+
+  // io_uring state
+  int nInflight;       // submitted operations whose completion is outstanding
+  SOCKET hFinished;    // socket of a finished probe, open until nInflight is 0
+  bool fSendPending;
+  bool fRecvPending;
+  vector<char, pool_allocator<char> > vchSend; // being sent; must not move while a send is in flight
+  vector<char, pool_allocator<char> > vchRecv;
+  struct __kernel_timespec ts; // for the one linked timeout a probe has queued
+
+  // pnode, if set, is an established connection from the keep-alive pool
+  CProbe(const CServiceResult &resIn, bool fGetAddrIn, bool fPipelineIn, bool fScanIn, CNode *pnode) : node(pnode), res(resIn), fGetAddr(fGetAddrIn), fPipeline(fPipelineIn), fScan(fScanIn), nNet(GetCrawlNet(resIn.service)), fConnected(false), fFailed(false), nLastRecv(0), nStartMillis(GetTimeMillis()), nIndex(-1), nEvents(0), nInflight(0), hFinished(INVALID_SOCKET), fSendPending(false), fRecvPending(false) {}
+  ~CProbe() {
+    delete node;
+    if (hFinished != INVALID_SOCKET)
+      close(hFinished);
+  }
+};
+
+// io_uring user_data is a CProbe pointer, with the operation in the low bits
+enum {
+  URING_CONNECT = 0, // connect, or poll during SOCKS negotiation
+  URING_SEND = 1,
+  URING_RECV = 2,
+  URING_TIMEOUT = 3,
+};
+
+CProbeEngine::CProbeEngine(bool fUseUring) : uring(NULL), nLastSweep(0), nScanning(0) {
+  for (int i=0; i<NET_MAX; i++)
+    vnCount[i] = 0;
+  if (fUseUring) {
+    uring = new CIoUring();
+    if (!uring->Init(4096)) {
+      delete uring;
+      uring = NULL;
+    }
+  }
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  // pending connections live in their own set; it becomes readable when
+  // any of them makes progress
+  struct epoll_event ev = {};
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  epoll_ctl(epfd, EPOLL_CTL_ADD, mux.GetFD(), &ev);
+}
+
+CProbeEngine::~CProbeEngine() {
+  // tearing down the ring cancels everything still in flight
+  delete uring;
+  for (int i=0; i<vProbes.size(); i++) {
+    if (vProbes[i]->node)
+      vProbes[i]->node->Finish(false);
+    delete vProbes[i];
+  }
+  for (int i=0; i<vFinished.size(); i++)
+    delete vFinished[i];
+  close(epfd);
+}
+
+void CProbeEngine::Watch(CProbe *probe, unsigned int nEvents) {
+  SOCKET hSocket = probe->node->GetSocket();
+  if (hSocket == INVALID_SOCKET || probe->nEvents == nEvents) return;
+  struct epoll_event ev = {};
+  ev.events = nEvents;
+  ev.data.ptr = probe;
+  epoll_ctl(epfd, probe->nEvents ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, hSocket, &ev);
+  probe->nEvents = nEvents;
+}
+
+bool CProbeEngine::Add(const CServiceResult &res, bool fGetAddr, bool fPipeline, bool fScan) {
+  // io_uring keeps a receive queued on every socket, so it cannot hand
+  // connections over to the pool
+  CNode *pnode = (fGetAddr || uring) ? NULL : keepalive.Take(res.service);
+  CProbe *probe = new CProbe(res, fGetAddr, fPipeline, fScan && !pnode, pnode);
+  if (probe->fScan)
+    nScanning++;
+  else
+    vnCount[probe->nNet]++;
+  CServiceResult &r = probe->res;
+  r.nBanTime = 0;
+  r.nClientV = 0;
+  r.nHeight = 0;
+  r.strClientV = "";
+  r.services = 0;
+  r.fGood = false;
+  probe->nIndex = vProbes.size();
+  vProbes.push_back(probe);
+  if (pnode) {
+    Connected(probe, true);
+    return true;
+  }
+  int nTimeout = latency.GetTimeout(r.service, LATENCY_CONNECT, nConnectTimeout);
+  if (!ConnectSocketAsync(r.service, *probe, nTimeout, uring == NULL)) {
+    probe->fFailed = true;
+    return probe->GetError() != EMFILE && probe->GetError() != ENFILE;
+  }
+  if (uring)
+    SubmitConnect(probe);
+  else
+    mux.Add(probe);
+  return true;
+}
+
+void CProbeEngine::Connected(CProbe *probe, bool fKept) {
+  probe->fConnected = true;
+  probe->nLastRecv = time(NULL);
+  if (probe->fScan) {
+    nScanning--;
+    vnCount[probe->nNet]++;
+    probe->fScan = false;
+  }
+  if (!fKept) {
+    latency.Record(probe->res.service, LATENCY_CONNECT, GetTimeMillis() - probe->nStartMillis);
+    // most addresses never get this far, so they never cost a CNode
+    probe->node = new CNode(probe->res.service, probe->fGetAddr ? &probe->vAddr : NULL, probe->fPipeline);
+  }
+  try {
+    if (fKept)
+      probe->node->Ping();
+    else
+      probe->node->Start(probe->Release());
+  } catch (std::ios_base::failure& e) {
+    probe->fFailed = true;
+  }
+  if (uring) {
+    SubmitSend(probe);
+    SubmitRecv(probe);
+    return;
+  }
+  probe->node->Send();
+  Watch(probe, EPOLLIN | (probe->node->WantsSend() ? EPOLLOUT : 0));
+}
+
+void CProbeEngine::Event(CProbe *probe, unsigned int nEvents) {
+  if (probe->fFailed) return;
+  try {
+    if (nEvents & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+      int nBytes = recv(probe->node->GetSocket(), pchBuf, sizeof(pchBuf), 0);
+      if (nBytes < 0 && (WSAGetLastError() == WSAEWOULDBLOCK || WSAGetLastError() == WSAEINTR))
+        return;
+      if (!probe->node->Receive(pchBuf, nBytes)) {
+        probe->fFailed = true;
+        return;
+      }
+      probe->nLastRecv = time(NULL);
+    }
+    probe->node->Send();
+  } catch (std::ios_base::failure& e) {
+    probe->fFailed = true;
+    return;
+  }
+  Watch(probe, EPOLLIN | (probe->node->WantsSend() ? EPOLLOUT : 0));
+}
+
+bool CProbeEngine::Check(CProbe *probe, int64 now, vector<CServiceResult> &vDone, vector<CAddress> &vAddr) {
+  bool ret;
+  if (probe->fFailed) {
+    ret = false;
+  } else if (!probe->fConnected) {
+    return false;
+  } else if (probe->node->IsDone(now)) {
+    ret = true;
+  } else if (now >= probe->node->GetDeadline(probe->nLastRecv)) {
+    ret = false;
+  } else {
+    return false;
+  }
+  CServiceResult &res = probe->res;
+  res.nError = probe->fConnected ? 0 : probe->GetError();
+  // a probe can fail before connecting without an errno, e.g. when the
+  // ring is full; that says nothing about the node
+  if (probe->fConnected)
+    res.nOutcome = OUTCOME_GOOD;
+  else
+    res.nOutcome = res.nError ? GetConnectOutcome(res.nError) : OUTCOME_LOCAL;
+  if (probe->fScan)
+    nScanning--;
+  else
+    vnCount[probe->nNet]--;
+  if (probe->fConnected) {
+    // make outstanding io_uring receives on the socket complete; queued
+    // operations refer to the socket by number, so it stays open until they
+    // are done, lest a new connection get the number
+    bool fLinger = probe->nInflight && probe->node->GetSocket() != INVALID_SOCKET;
+    if (fLinger)
+      shutdown(probe->node->GetSocket(), SHUT_RDWR);
+    res.fGood = probe->node->Finish(ret && !probe->fFailed, keepalive.IsEnabled() && !uring, fLinger ? &probe->hFinished : NULL);
+    res.nBanTime = res.fGood ? 0 : probe->node->GetBan();
+    res.nClientV = probe->node->GetClientVersion();
+    res.strClientV = probe->node->GetClientSubVersion();
+    res.nHeight = probe->node->GetStartingHeight();
+    res.services = probe->node->GetServices();
+    if (!res.fGood)
+      res.nOutcome = probe->node->GetOutcome(probe->fFailed);
+    if (probe->node->GetSocket() != INVALID_SOCKET) {
+      epoll_ctl(epfd, EPOLL_CTL_DEL, probe->node->GetSocket(), NULL);
+      keepalive.Put(probe->node, probe->res.fPrevGood);
+      probe->node = NULL;
+    }
+  }
+  vDone.push_back(res);
+  vAddr.insert(vAddr.end(), probe->vAddr.begin(), probe->vAddr.end());
+  CProbe *last = vProbes.back();
+  last->nIndex = probe->nIndex;
+  vProbes[probe->nIndex] = last;
+  vProbes.pop_back();
+  if (probe->nInflight) {
+    probe->nIndex = vFinished.size();
+    vFinished.push_back(probe);
+  } else {
+    delete probe;
+  }
+  return true;
+}
+
+void CProbeEngine::PollEpoll(int nMilliSec, vector<CServiceResult> &vDone, vector<CAddress> &vAddr) {
+  struct epoll_event events[256];
+  int64 nNowMillis = GetTimeMillis();
+  // never sleep past the next second, as that is when deadlines can expire
+  if (!vProbes.empty() && nMilliSec > 1000 - nNowMillis % 1000)
+    nMilliSec = 1000 - nNowMillis % 1000;
+  if (mux.size() && mux.GetNextDeadline() - nNowMillis < nMilliSec)
+    nMilliSec = std::max(mux.GetNextDeadline() - nNowMillis, (int64)0);
+  int n = epoll_wait(epfd, events, ARRAYLEN(events), nMilliSec);
+  bool fMux = false;
+  for (int i=0; i<n; i++) {
+    if (events[i].data.ptr == NULL) {
+      fMux = true;
+      continue;
+    }
+    Event((CProbe*)events[i].data.ptr, events[i].events);
+  }
+  int64 now = time(NULL);
+  nNowMillis = GetTimeMillis();
+  std::vector<CPendingConnect*> vConn;
+  if (fMux || (mux.size() && mux.GetNextDeadline() <= nNowMillis))
+    mux.Wait(0, vConn);
+  for (int i=0; i<vConn.size(); i++) {
+    CProbe *probe = static_cast<CProbe*>(vConn[i]);
+    if (probe->IsDone())
+      Connected(probe);
+    else
+      probe->fFailed = true;
+  }
+  if (now != nLastSweep) {
+    nLastSweep = now;
+    for (int i=0; i<vProbes.size(); ) {
+      if (!Check(vProbes[i], now, vDone, vAddr)) i++;
+    }
+  } else {
+    // epoll reports each socket at most once per batch
+    for (int i=0; i<n; i++)
+      if (events[i].data.ptr)
+        Check((CProbe*)events[i].data.ptr, now, vDone, vAddr);
+    for (int i=0; i<vConn.size(); i++)
+      Check(static_cast<CProbe*>(vConn[i]), now, vDone, vAddr);
+  }
+}
+
+struct io_uring_sqe *CProbeEngine::NewSqe(CProbe *probe, int nTag) {
+  struct io_uring_sqe *sqe = uring->GetSqe();
+  if (sqe) {
+    sqe->user_data = (uint64_t)probe | nTag;
+    probe->nInflight++;
+  }
+  return sqe;
+}
+
+// bound the operation in sqe by nDeadline (in milliseconds)
+void CProbeEngine::LinkTimeout(CProbe *probe, struct io_uring_sqe *sqe, int64 nDeadline) {
+  int64 nMilliSec = std::max(nDeadline - GetTimeMillis(), (int64)0);
+  probe->ts.tv_sec = nMilliSec / 1000;
+  probe->ts.tv_nsec = (nMilliSec % 1000) * 1000000;
+  sqe->flags |= IOSQE_IO_LINK;
+  struct io_uring_sqe *tsqe = NewSqe(probe, URING_TIMEOUT);
+  if (!tsqe) {
+    sqe->flags &= ~IOSQE_IO_LINK;
+    return;
+  }
+  tsqe->opcode = IORING_OP_LINK_TIMEOUT;
+  tsqe->fd = -1;
+  tsqe->addr = (uint64_t)&probe->ts;
+  tsqe->len = 1;
+}
+
+void CProbeEngine::SubmitConnect(CProbe *probe) {
+  uring->Reserve(2);
+  struct io_uring_sqe *sqe = NewSqe(probe, URING_CONNECT);
+  if (!sqe) {
+    probe->fFailed = true;
+    return;
+  }
+  sqe->fd = probe->GetSocket();
+  if (probe->IsConnecting()) {
+    socklen_t len;
+    sqe->opcode = IORING_OP_CONNECT;
+    sqe->addr = (uint64_t)probe->GetSockAddr(len);
+    sqe->off = len;
+  } else {
+    // SOCKS negotiation in progress
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->poll32_events = probe->WantsWrite() ? POLLOUT : POLLIN;
+  }
+  LinkTimeout(probe, sqe, probe->GetDeadline());
+}
+
+void CProbeEngine::SubmitSend(CProbe *probe) {
+  if (probe->fSendPending || probe->fFailed) return;
+  probe->node->TakeSend(probe->vchSend);
+  if (probe->vchSend.empty()) return;
+  struct io_uring_sqe *sqe = NewSqe(probe, URING_SEND);
+  if (!sqe) {
+    probe->fFailed = true;
+    return;
+  }
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = probe->node->GetSocket();
+  sqe->addr = (uint64_t)&probe->vchSend[0];
+  sqe->len = probe->vchSend.size();
+  sqe->msg_flags = MSG_NOSIGNAL;
+  probe->fSendPending = true;
+}
+
+void CProbeEngine::SubmitRecv(CProbe *probe) {
+  if (probe->fRecvPending || probe->fFailed) return;
+  if (probe->vchRecv.empty())
+    probe->vchRecv.resize(0x1000);
+  uring->Reserve(2);
+  struct io_uring_sqe *sqe = NewSqe(probe, URING_RECV);
+  if (!sqe) {
+    probe->fFailed = true;
+    return;
+  }
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = probe->node->GetSocket();
+  sqe->addr = (uint64_t)&probe->vchRecv[0];
+  sqe->len = probe->vchRecv.size();
+  probe->fRecvPending = true;
+  LinkTimeout(probe, sqe, probe->node->GetDeadline(probe->nLastRecv) * 1000);
+}
+
+void CProbeEngine::Complete(CProbe *probe, int nTag, int res) {
+  switch (nTag) {
+    case URING_CONNECT:
+      if (res == -ECANCELED)
+        probe->Expire();
+      else if (probe->IsConnecting())
+        probe->Connected(-res);
+      else
+        probe->Process();
+      if (probe->IsDone())
+        Connected(probe);
+      else if (probe->IsFailed())
+        probe->fFailed = true;
+      else
+        SubmitConnect(probe);
+      break;
+
+    case URING_SEND:
+      probe->fSendPending = false;
+      if (res <= 0) {
+        probe->fFailed = true;
+        break;
+      }
+      probe->vchSend.erase(probe->vchSend.begin(), probe->vchSend.begin() + res);
+      SubmitSend(probe);
+      break;
+
+    case URING_RECV:
+      probe->fRecvPending = false;
+      if (res == -ECANCELED) {
+        // the linked timeout fired; Check() decides what that means
+        break;
+      }
+      try {
+        if (!probe->node->Receive(&probe->vchRecv[0], res)) {
+          probe->fFailed = true;
+          break;
+        }
+      } catch (std::ios_base::failure& e) {
+        probe->fFailed = true;
+        break;
+      }
+      probe->nLastRecv = time(NULL);
+      SubmitSend(probe);
+      break;
+  }
+}
+
+void CProbeEngine::PollUring(int nMilliSec, vector<CServiceResult> &vDone, vector<CAddress> &vAddr) {
+  int64 nNowMillis = GetTimeMillis();
+  if (!vProbes.empty() && nMilliSec > 1000 - nNowMillis % 1000)
+    nMilliSec = 1000 - nNowMillis % 1000;
+  uring->Submit(nMilliSec);
+  int64 now = time(NULL);
+  struct io_uring_cqe *cqe;
+  while ((cqe = uring->PeekCqe()) != NULL) {
+    CProbe *probe = (CProbe*)(cqe->user_data & ~(uint64_t)3);
+    int nTag = cqe->user_data & 3;
+    int res = cqe->res;
+    uring->SeenCqe();
+    probe->nInflight--;
+    if (probe->nIndex >= 0 && probe->nIndex < vFinished.size() && vFinished[probe->nIndex] == probe) {
+      if (probe->nInflight == 0) {
+        CProbe *last = vFinished.back();
+        last->nIndex = probe->nIndex;
+        vFinished[probe->nIndex] = last;
+        vFinished.pop_back();
+        delete probe;
+      }
+      continue;
+    }
+    if (nTag == URING_TIMEOUT) continue;
+    Complete(probe, nTag, res);
+    if (!Check(probe, now, vDone, vAddr) && probe->fConnected)
+      SubmitRecv(probe);
+  }
+  if (now != nLastSweep) {
+    nLastSweep = now;
+    for (int i=0; i<vProbes.size(); ) {
+      if (!Check(vProbes[i], now, vDone, vAddr)) i++;
+    }
+  }
+}
+
+void CProbeEngine::Poll(int nMilliSec, vector<CServiceResult> &vDone, vector<CAddress> &vAddr) {
+  if (uring)
+    PollUring(nMilliSec, vDone, vAddr);
+  else
+    PollEpoll(nMilliSec, vDone, vAddr);
+}
+
 /*
 int main(void) {
   CService ip("bitcoin.sipa.be", 8333, true);
@@ -1,8 +1,103 @@
 #ifndef _BITCOIN_H_
 #define _BITCOIN_H_ 1
 
+#include <map>
+#include <set>
+
+#include "netbase.h"
 #include "protocol.h"
+#include "util.h"
+
+struct CServiceResult;
+class CIoUring;
+class CNode;
+
+bool TestNode(const CService &cip, int &ban, int &client, std::string &clientSV, int &blocks, std::vector<CAddress>* vAddr, uint64_t& services, int &error, int &outcome, bool fPipeline = false, bool fKeep = false);
+
+// Connections to good nodes that are left open after their probe. Revisiting
+// such a node takes a ping instead of a new connection and handshake; in
+// between, its pings are answered from a thread of its own.
+class CKeepAlivePool {
+private:
+  CCriticalSection cs;
+  int epfd;
+  int nMax;
+  std::map<CService, CNode*> mapIdle;
+  std::map<CNode*, int64> mapIdleSince; // when each connection went idle
+  int64 nLastSweep;
+  char pchBuf[0x10000];
+
+  void Drop(CNode *node);
+  void Expire(int64 now); // drop connections idle for too long
+
+public:
+  CKeepAlivePool();
+
+  // keep up to nMaxIn connections; the pool is disabled until this is called
+  void Init(int nMaxIn);
+  bool IsEnabled() const { return nMax > 0; }
+  int GetCount();
+
+  // remove the connection to service from the pool, if there is one
+  CNode *Take(const CService &service);
+
+  // take ownership of a node that finished its probe with the socket open;
+  // it is kept only if fGood, the database's verdict on the node, and the
+  // pool has room
+  void Put(CNode *node, bool fGood);
+
+  // answer pings, and drop closed and expired connections; does not return
+  void Run();
+};
+
+extern CKeepAlivePool keepalive;
+
+// Drives many probes from a single thread, using non-blocking sockets and
+// either epoll, or io_uring with batched submissions and linked timeouts.
+class CProbeEngine {
+private:
+  struct CProbe;
+  int epfd;
+  CIoUring *uring;
+  int64 nLastSweep;
+  int nScanning;                   // scan probes that are still connecting
+  int vnCount[NET_MAX];            // the other probes, per crawl network
+  std::vector<CProbe*> vProbes;
+  std::vector<CProbe*> vFinished;  // done, but with io_uring operations outstanding
+  CConnectMux mux;
+  char pchBuf[0x10000];
+
+  void Watch(CProbe *probe, unsigned int nEvents);
+  void Connected(CProbe *probe, bool fKept = false);
+  void Event(CProbe *probe, unsigned int nEvents);
+  bool Check(CProbe *probe, int64 now, std::vector<CServiceResult> &vDone, std::vector<CAddress> &vAddr);
+  void PollEpoll(int nMilliSec, std::vector<CServiceResult> &vDone, std::vector<CAddress> &vAddr);
+
+  struct io_uring_sqe *NewSqe(CProbe *probe, int nTag);
+  void LinkTimeout(CProbe *probe, struct io_uring_sqe *sqe, int64 nDeadline);
+  void SubmitConnect(CProbe *probe);
+  void SubmitSend(CProbe *probe);
+  void SubmitRecv(CProbe *probe);
+  void Complete(CProbe *probe, int nTag, int res);
+  void PollUring(int nMilliSec, std::vector<CServiceResult> &vDone, std::vector<CAddress> &vAddr);
+
+public:
+  CProbeEngine(bool fUseUring = false);
+  ~CProbeEngine();
+
+  int GetCount() const { return vProbes.size() - nScanning; }
+  int GetCount(int nNet) const { return vnCount[nNet]; }
+  int GetScanCount() const { return nScanning; }
+  bool IsUring() const { return uring != NULL; }
+
+  // start probing res.service, sending our whole handshake at once if
+  // fPipeline; returns false when out of file descriptors. Scan probes,
+  // of addresses never tried, are counted apart until they connect.
+  bool Add(const CServiceResult &res, bool fGetAddr, bool fPipeline = false, bool fScan = false);
 
-bool TestNode(const CService &cip, int &ban, int &client, std::string &clientSV, int &blocks, std::vector<CAddress>* vAddr, uint64_t& services);
+  // wait for network activity, and append finished probes to vDone, and
+  // addresses they learned to vAddr
+  void Poll(int nMilliSec, std::vector<CServiceResult> &vDone, std::vector<CAddress> &vAddr);
+};
 
 #endif
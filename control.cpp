@@ -0,0 +1,129 @@
+#include <errno.h>
+#include <sys/resource.h>
+
+#include "control.h"
+
+#define ADJUST_PERIOD 5000 // milliseconds
+#define MIN_SAMPLES 20     // connects needed to judge the timeout rate
+
+using namespace std;
+
+static int64 GetCpuMicros() {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage))
+    return 0;
+  return (int64)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+CCrawlControl::CCrawlControl() : nMin(1), nMax(1), nStep(1), nCpus(1), nLimit(1), nActive(0), nPeakActive(0), nConnected(0), nTimeouts(0), nFailed(0), nResource(0),
+                                 dTimeoutRate(-1), dCpu(0), nLastAdjust(0), nLastCpu(0), cAction('='), strReason("start") {}
+
+void CCrawlControl::Init(int nInitial, int nMinIn, int nMaxIn, int nCpusIn) {
+  CRITICAL_BLOCK(cs) {
+    nMin = std::max(nMinIn, 1);
+    nMax = std::max(nMaxIn, nMin);
+    nLimit = std::min(std::max(nInitial, nMin), nMax);
+    nStep = std::max(nMax / 32, 1);
+    nCpus = std::max(nCpusIn, 1);
+    nLastAdjust = GetTimeMillis();
+    nLastCpu = GetCpuMicros();
+  }
+}
+
+int CCrawlControl::Acquire(int nWant) {
+  int nRet = 0;
+  CRITICAL_BLOCK(cs) {
+    nRet = std::max(std::min(nWant, nLimit - nActive), 0);
+    nActive += nRet;
+    nPeakActive = std::max(nPeakActive, nActive);
+  }
+  return nRet;
+}
+
+void CCrawlControl::Release(int nCount) {
+  CRITICAL_BLOCK(cs)
+    nActive -= nCount;
+}
+
+void CCrawlControl::Report(int nError) {
+  CRITICAL_BLOCK(cs) {
+    switch (nError) {
+      case 0:
+        nConnected++;
+        break;
+      case ETIMEDOUT:
+        nTimeouts++;
+        break;
+      case EMFILE:
+      case ENFILE:
+      case ENOBUFS:
+      case ENOMEM:
+      case EADDRNOTAVAIL:
+        nResource++;
+        break;
+      default:
+        nFailed++;
+    }
+  }
+}
+
+void CCrawlControl::Adjust() {
+  int64 now = GetTimeMillis();
+  CRITICAL_BLOCK(cs) {
+    if (now - nLastAdjust < ADJUST_PERIOD)
+      return;
+    int64 nCpu = GetCpuMicros();
+    dCpu = (double)(nCpu - nLastCpu) / ((now - nLastAdjust) * 1000.0 * nCpus);
+    nLastCpu = nCpu;
+    nLastAdjust = now;
+
+    int nTotal = nConnected + nTimeouts + nFailed;
+    double dRate = nTotal ? (double)nTimeouts / nTotal : 0;
+    bool fJudgeTimeouts = nTotal >= MIN_SAMPLES && dTimeoutRate >= 0;
+    if (!IsAdaptive()) {
+      cAction = '=';
+      strReason = "fixed";
+    } else if (nResource) {
+      nLimit /= 2;
+      cAction = '-';
+      strReason = "out of fds/ports";
+    } else if (dCpu > 0.9) {
+      nLimit = nLimit * 3 / 4;
+      cAction = '-';
+      strReason = "cpu";
+    } else if (fJudgeTimeouts && dRate > dTimeoutRate * 1.5 + 0.05) {
+      nLimit = nLimit * 3 / 4;
+      cAction = '-';
+      strReason = "timeouts";
+    } else if (nPeakActive >= nLimit) {
+      nLimit += nStep;
+      cAction = '+';
+      strReason = "saturated";
+    } else {
+      cAction = '=';
+      strReason = "idle";
+    }
+    nLimit = std::min(std::max(nLimit, nMin), nMax);
+
+    // track the rate even while backing off, so a lasting change in the
+    // network is absorbed instead of shrinking the limit forever
+    if (nTotal >= MIN_SAMPLES)
+      dTimeoutRate = dTimeoutRate < 0 ? dRate : dTimeoutRate * 0.8 + dRate * 0.2;
+    nConnected = nTimeouts = nFailed = nResource = 0;
+    nPeakActive = nActive;
+  }
+}
+
+int CCrawlControl::GetLimit() {
+  int nRet = 0;
+  SHARED_CRITICAL_BLOCK(cs)
+    nRet = nLimit;
+  return nRet;
+}
+
+string CCrawlControl::GetStatus() {
+  string ret;
+  SHARED_CRITICAL_BLOCK(cs)
+    ret = strprintf("%i/%i probes (%c %s, %i%% cpu, %i%% timeouts)", nActive, nLimit, cAction, strReason, (int)(dCpu * 100), (int)(std::max(dTimeoutRate, 0.0) * 100));
+  return ret;
+}
@@ -0,0 +1,58 @@
+#ifndef _CONTROL_H_
+#define _CONTROL_H_ 1
+
+#include <string>
+
+#include "util.h"
+
+// AIMD controller for the number of probes in flight. The limit grows
+// additively while it is what holds the crawlers back, and is cut
+// multiplicatively when we run out of file descriptors or local ports, when
+// the crawlers use up their cpu, or when the share of connect timeouts jumps.
+class CCrawlControl {
+private:
+  CCriticalSection cs;
+  int nMin;
+  int nMax;
+  int nStep;
+  int nCpus;          // cores available to the crawlers
+  int nLimit;
+  int nActive;
+  int nPeakActive;    // highest nActive since the last adjustment
+
+  // connect outcomes since the last adjustment
+  int nConnected;
+  int nTimeouts;
+  int nFailed;
+  int nResource;
+
+  double dTimeoutRate; // smoothed share of connects that time out (-1: unknown)
+  double dCpu;         // share of nCpus used in the last period
+  int64 nLastAdjust;   // in milliseconds
+  int64 nLastCpu;      // process cpu time, in microseconds
+  char cAction;        // last decision: '+', '-' or '='
+  const char *strReason;
+
+public:
+  CCrawlControl();
+
+  // adapt between nMinIn and nMaxIn, starting at nInitial; nMinIn == nMaxIn
+  // gives a fixed limit
+  void Init(int nInitial, int nMinIn, int nMaxIn, int nCpusIn);
+  bool IsAdaptive() const { return nMin < nMax; }
+
+  // take up to nWant probe slots, and return how many were granted
+  int Acquire(int nWant = 1);
+  void Release(int nCount = 1);
+
+  // record the outcome of a connection attempt (errno, or 0 if it connected)
+  void Report(int nError);
+
+  // reconsider the limit; does nothing until the current period is over
+  void Adjust();
+
+  int GetLimit();
+  std::string GetStatus();
+};
+
+#endif
@@ -1,12 +1,90 @@
 #include "db.h"
+#include "siphash.h"
+#include <errno.h>
 #include <stdlib.h>
 
+#include <limits>
+#include <random>
+
 using namespace std;
 
 int nMinimumHeight = 0;
 
-void CAddrInfo::Update(bool good) {
-  uint32_t now = time(NULL);
+int64 nTierTarget[TIER_MAX] = {20*60, 2*3600, 0};
+
+// retry policy per outcome: the first backoff, its growth with every further
+// failure, and its cap (all in seconds)
+static const struct {
+  int nBase;
+  int nFactor;
+  int nMax;
+} vBackoff[OUTCOME_MAX] = {
+  {0, 1, 0},                // good
+  {4*3600, 4, 30*86400},    // refused: nobody listens, and that rarely changes soon
+  {2*3600, 2, 14*86400},    // timeout: down or filtered, or just slow; each costs a full timeout
+  {1800, 2, 86400},         // reset: up, but maybe full
+  {3600, 2, 3*86400},       // silent
+  {0, 1, 0},                // protocol: banned instead
+  {0, 1, 0},                // local: not held against the node
+};
+
+int GetConnectOutcome(int nError) {
+  switch (nError) {
+    case 0:
+      return OUTCOME_GOOD;
+    case ECONNREFUSED:
+    case EHOSTUNREACH:
+    case ENETUNREACH:
+    case EHOSTDOWN:
+      return OUTCOME_REFUSED;
+    case EMFILE:
+    case ENFILE:
+    case ENOBUFS:
+    case ENOMEM:
+    case EADDRNOTAVAIL:
+    case EPROXY:
+      return OUTCOME_LOCAL;
+    default:
+      return OUTCOME_TIMEOUT;
+  }
+}
+
+int CAddrInfo::GetBackoffTime() const {
+  if (failures == 0 || outcome >= OUTCOME_MAX) return 0;
+  int64 ign = vBackoff[outcome].nBase;
+  for (int i = 1; i < failures && ign < vBackoff[outcome].nMax; i++)
+    ign *= vBackoff[outcome].nFactor;
+  return std::min(ign, (int64)vBackoff[outcome].nMax);
+}
+
+int CAddrInfo::GetProbesToFlip(int64 nInterval) const {
+  bool fGood = IsGood();
+  CAddrInfo next = *this;
+  for (int n = 1; n <= MAX_FLIP_PROBES; n++) {
+    next.Update(fGood ? OUTCOME_SILENT : OUTCOME_GOOD, next.ourLastTry + nInterval);
+    if (next.IsGood() != fGood)
+      return n;
+  }
+  return MAX_FLIP_PROBES + 1;
+}
+
+double CAddrInfo::GetFlipChance(int64 nInterval) const {
+  int n = GetProbesToFlip(nInterval);
+  if (n > MAX_FLIP_PROBES) return 0;
+  // the daily success rate, pulled towards 50% while there is little history
+  double dSuccess = (stat1D.reliability + 0.05) / (stat1D.weight + 0.1);
+  return pow(IsGood() ? 1.0 - dSuccess : dSuccess, n);
+}
+
+void CAddrInfo::Update(int nOutcome) {
+  Update(nOutcome, time(NULL));
+}
+
+void CAddrInfo::Update(int nOutcome, int64 now) {
+  bool good = nOutcome == OUTCOME_GOOD;
+  if (good || nOutcome != outcome) failures = 0;
+  outcome = nOutcome;
+  if (!good) failures++;
   if (ourLastTry == 0)
     ourLastTry = now - MIN_RETRY;
   int age = now - ourLastTry;
@@ -32,71 +110,187 @@ void CAddrInfo::Update(bool good) {
 //  100.0 * stat1W.reliability, 100.0 * (stat1W.reliability + 1.0 - stat1W.weight), stat1W.count);
 }
 
-bool CAddrDb::Get_(CServiceResult &ip, int &wait) {
+CAddrShard::CAddrShard() : nDirty(0), limiter(NULL), filter(NULL) {
+  for (int tier = 0; tier < TIER_UNKNOWN; tier++)
+    nVisits[tier] = nLateVisits[tier] = 0;
+  for (int net = 0; net < NET_MAX; net++)
+    nActive[net] = 0;
+}
+
+// An IP whose netgroup is out of attempts or probes goes back to wait, and
+// the next one is looked at, so one busy netgroup holds up nobody else.
+bool CAddrShard::PopAdmitted_(CTimingWheel &wheel, int64 now, int &id) {
+  int64 nRetry;
+  while (wheel.Pop(now, id)) {
+    if (limiter->Start(idToInfo[id].ip, now, nRetry))
+      return true;
+    wheel.Schedule(id, nRetry);
+  }
+  return false;
+}
+
+bool CAddrShard::PopUnknown_(int64 now, int &id, int nNet) {
+  int64 nRetry;
+  while (!unkId[nNet].empty()) {
+    id = unkId[nNet].GetRandom();
+    unkId[nNet].erase(id);
+    if (limiter->Start(idToInfo[id].ip, now, nRetry))
+      return true;
+    unkHeld[nNet].Schedule(id, nRetry);
+  }
+  return false;
+}
+
+bool CAddrShard::Get_(CServiceResult &ip, int &wait, int nNet, bool fRevisitsOnly) {
   int64 now = time(NULL);
-  int cont = 0;
-  int tot = unkId.size() + ourId.size();
-  if (tot == 0) {
-    wait = 5;
+  // with nothing of nNet here at all, there is nothing to wait for either
+  if (GetUnknownCount_(nNet) + GetTrackedCount_(nNet) == 0)
     return false;
-  }
-  do {
-    int rnd = rand() % tot;
-    int ret;
-    if (rnd < unkId.size()) {
-      set<int>::iterator it = unkId.end(); it--;
-      ret = *it;
-      unkId.erase(it);
-    } else {
-      ret = ourId.front();
-      if (time(NULL) - idToInfo[ret].ourLastTry < MIN_RETRY) return false;
-      ourId.pop_front();
+  // tiers in order of priority: whatever is due in a tier with a target
+  // goes first, so floods of new addresses cannot delay revisits
+  int ret;
+  int tier = 0;
+  while (tier < TIER_UNKNOWN && !PopAdmitted_(ourId[nNet][tier], now, ret))
+    tier++;
+  if (tier < TIER_UNKNOWN) {
+    nVisits[tier]++;
+    if (now > GetDeadline_(idToInfo[ret], tier))
+      nLateVisits[tier]++;
+  } else if (fRevisitsOnly || (!PopAdmitted_(unkHeld[nNet], now, ret) && !PopUnknown_(now, ret, nNet))) {
+    // sleep until the next one is due, but look for new addresses now and then
+    wait = 60;
+    for (int t = 0; t <= TIER_UNKNOWN; t++) {
+      int next;
+      int64 nDue;
+      if ((t < TIER_UNKNOWN ? ourId[nNet][t] : unkHeld[nNet]).GetNext(next, nDue))
+        wait = std::min(std::max(nDue - now, (int64)1), (int64)wait);
     }
-    if (idToInfo[ret].ignoreTill && idToInfo[ret].ignoreTill < now) {
-      ourId.push_back(ret);
-      idToInfo[ret].ourLastTry = now;
-    } else {
-      ip.service = idToInfo[ret].ip;
-      ip.ourLastSuccess = idToInfo[ret].ourLastSuccess;
-      break;
-    }
-  } while(1);
+    return false;
+  }
+  Fill_(ret, ip);
+  nDirty++;
+  return true;
+}
+
+bool CAddrShard::GetUnknown_(CServiceResult &ip, int nNet) {
+  int64 now = time(NULL);
+  int ret;
+  if (!PopAdmitted_(unkHeld[nNet], now, ret) && !PopUnknown_(now, ret, nNet))
+    return false;
+  Fill_(ret, ip);
   nDirty++;
   return true;
 }
 
-int CAddrDb::Lookup_(const CService &ip) {
-  if (ipToId.count(ip))
-    return ipToId[ip];
-  return -1;
+void CAddrShard::Fill_(int id, CServiceResult &ip) {
+  nActive[GetCrawlNet(idToInfo[id].ip)]++;
+  ip.service = idToInfo[id].ip;
+  ip.ourLastSuccess = idToInfo[id].ourLastSuccess;
+  ip.nPrevClientV = idToInfo[id].clientVersion;
+  ip.fPrevGood = goodId.count(id);
+  ip.nError = 0;
+  ip.nOutcome = OUTCOME_GOOD;
+}
+
+// A node is revisited ahead of its tier's target, which leaves the crawlers
+// room to catch up when they fall behind. How far ahead depends on how likely
+// the next probes are to move it across the good/bad line: such nodes go
+// early, and settled ones wait almost the full target, though no less than
+// MIN_RETRY.
+int64 CAddrShard::GetDue_(const CAddrInfo &info, int tier) {
+  if (!nTierTarget[tier])
+    return std::max(info.ourLastTry + MIN_RETRY, info.ignoreTill);
+  double dChance = info.GetFlipChance(nTierTarget[tier] * 3 / 4);
+  int nPercent = dChance >= 0.25 ? 25 : dChance >= 0.05 ? 50 : dChance >= 0.01 ? 75 : 90;
+  int64 nInterval = nTierTarget[tier] * nPercent / 100;
+  return std::max(info.ourLastTry + std::max<int64>(nInterval, MIN_RETRY), info.ignoreTill);
+}
+
+int64 CAddrShard::GetDeadline_(const CAddrInfo &info, int tier) {
+  if (!nTierTarget[tier]) return std::numeric_limits<int64>::max();
+  return std::max(info.ourLastTry + nTierTarget[tier], info.ignoreTill);
+}
+
+void CAddrShard::Schedule_(int id, int64 nNotBefore) {
+  const CAddrInfo &info = idToInfo[id];
+  CTimingWheel *wheel = ourId[GetCrawlNet(info.ip)];
+  int tier = goodId.count(id) ? TIER_GOOD : TIER_TRACKED;
+  wheel[tier == TIER_GOOD ? TIER_TRACKED : TIER_GOOD].Remove(id);
+  wheel[tier].Schedule(id, std::max(GetDue_(info, tier), nNotBefore));
+}
+
+int CAddrShard::GetTrackedCount_() const {
+  int n = 0;
+  for (int net = 0; net < NET_MAX; net++)
+    n += GetTrackedCount_(net);
+  return n;
+}
+
+int CAddrShard::GetUnknownCount_() const {
+  int n = 0;
+  for (int net = 0; net < NET_MAX; net++)
+    n += GetUnknownCount_(net);
+  return n;
+}
+
+bool CAddrShard::IsTracked_(int id) const {
+  const CAddrInfo *info = idToInfo.find(id);
+  if (!info) return false;
+  const CTimingWheel *wheel = ourId[GetCrawlNet(info->ip)];
+  return wheel[TIER_GOOD].count(id) || wheel[TIER_TRACKED].count(id);
+}
+
+void CAddrShard::Finish_(const CService &ip) {
+  limiter->Finish(ip);
+  int &n = nActive[GetCrawlNet(ip)];
+  if (n > 0) n--;
+}
+
+void CAddrShard::UpdateGood_(int id) {
+  bool fGood = goodId.count(id);
+  uint64_t services = idToInfo[id].services;
+  for (map<uint64_t, CSlotIdSet>::iterator it = mapGoodFiltered.begin(); it != mapGoodFiltered.end(); it++) {
+    if (fGood && (services & it->first) == it->first)
+      it->second.insert(id);
+    else
+      it->second.erase(id);
+  }
+}
+
+int CAddrShard::Lookup_(const CService &ip) {
+  return ipToId.Find(ip);
 }
 
-void CAddrDb::Good_(const CService &addr, int clientV, std::string clientSV, int blocks, uint64_t services) {
+void CAddrShard::Good_(const CService &addr, int clientV, std::string clientSV, int blocks, uint64_t services) {
+  Finish_(addr);
   int id = Lookup_(addr);
   if (id == -1) return;
-  unkId.erase(id);
+  unkId[GetCrawlNet(addr)].erase(id);
   banned.erase(addr);
   CAddrInfo &info = idToInfo[id];
   info.clientVersion = clientV;
   info.clientSubVersion = clientSV;
   info.blocks = blocks;
   info.services = services;
-  info.Update(true);
+  info.Update(OUTCOME_GOOD);
+  filter->Set(addr, info.lastTry);
   if (info.IsGood() && goodId.count(id)==0) {
     goodId.insert(id);
 //    printf("%s: good; %i good nodes now\n", ToString(addr).c_str(), (int)goodId.size());
   }
+  UpdateGood_(id);
   nDirty++;
-  ourId.push_back(id);
+  Schedule_(id);
 }
 
-void CAddrDb::Bad_(const CService &addr, int ban)
+void CAddrShard::Bad_(const CService &addr, int ban, int outcome)
 {
+  Finish_(addr);
   int id = Lookup_(addr);
   if (id == -1) return;
-  unkId.erase(id);
+  unkId[GetCrawlNet(addr)].erase(id);
   CAddrInfo &info = idToInfo[id];
-  info.Update(false);
+  info.Update(outcome);
   uint32_t now = time(NULL);
   int ter = info.GetBanTime();
   if (ter) {
@@ -106,31 +300,44 @@ void CAddrDb::Bad_(const CService &addr, int ban)
   if (ban > 0) {
 //    printf("%s: ban for %i seconds\n", ToString(addr).c_str(), ban);
     banned[info.ip] = ban + now;
+    filter->Set(info.ip, ban + now);
     ipToId.erase(info.ip);
     goodId.erase(id);
+    UpdateGood_(id);
+    ourId[GetCrawlNet(addr)][TIER_GOOD].Remove(id);
+    ourId[GetCrawlNet(addr)][TIER_TRACKED].Remove(id);
     idToInfo.erase(id);
   } else {
+    filter->Set(info.ip, info.lastTry);
     if (/*!info.IsGood() && */ goodId.count(id)==1) {
       goodId.erase(id);
+      UpdateGood_(id);
 //      printf("%s: not good; %i good nodes left\n", ToString(addr).c_str(), (int)goodId.size());
     }
-    ourId.push_back(id);
+    Schedule_(id);
   }
   nDirty++;
 }
 
-void CAddrDb::Skipped_(const CService &addr)
+void CAddrShard::Skipped_(const CService &addr)
 {
+  Finish_(addr);
   int id = Lookup_(addr);
   if (id == -1) return;
-  unkId.erase(id);
-  ourId.push_back(id);
+  // one that was never tried stays among the unknowns, for the scan stage
+  if (!idToInfo[id].ourLastTry) {
+    unkId[GetCrawlNet(addr)].insert(id);
+    nDirty++;
+    return;
+  }
+  unkId[GetCrawlNet(addr)].erase(id);
+  Schedule_(id, time(NULL));
 //  printf("%s: skipped\n", ToString(addr).c_str());
   nDirty++;
 }
 
 
-void CAddrDb::Add_(const CAddress &addr, bool force) {
+void CAddrShard::Add_(const CAddress &addr, bool force) {
   if (!force && !addr.IsRoutable())
     return;
   CService ipp(addr);
@@ -141,9 +348,13 @@ void CAddrDb::Add_(const CAddress &addr, bool force) {
     else
       return;
   }
-  if (ipToId.count(ipp)) {
-    CAddrInfo &ai = idToInfo[ipToId[ipp]];
-    if (addr.nTime > ai.lastTry) ai.lastTry = addr.nTime;
+  int nKnown = ipToId.Find(ipp);
+  if (nKnown != -1) {
+    CAddrInfo &ai = idToInfo[nKnown];
+    if (addr.nTime > ai.lastTry) {
+      ai.lastTry = addr.nTime;
+      filter->Set(ipp, ai.lastTry);
+    }
     // Do not update ai.nServices (data from VERSION from the peer itself is better than random ADDR rumours).
     if (force) {
       ai.ignoreTill = 0;
@@ -157,45 +368,82 @@ void CAddrDb::Add_(const CAddress &addr, bool force) {
   ai.ourLastTry = 0;
   ai.total = 0;
   ai.success = 0;
-  int id = nId++;
-  idToInfo[id] = ai;
-  ipToId[ipp] = id;
-//  printf("%s: added\n", ToString(ipp).c_str(), ipToId[ipp]);
-  unkId.insert(id);
+  int id = idToInfo.insert(ai);
+  if (id == -1) return;
+  ipToId.Set(ipp, id);
+  filter->Set(ipp, ai.lastTry);
+//  printf("%s: added\n", ToString(ipp).c_str(), id);
+  unkId[GetCrawlNet(ipp)].insert(id);
   nDirty++;
 }
 
-void CAddrDb::GetIPs_(set<CNetAddr>& ips, uint64_t requestedFlags, int max, const bool* nets) {
-  if (goodId.size() == 0) {
-    int id = -1;
-    if (ourId.size() == 0) {
-      if (unkId.size() == 0) return;
-      id = *unkId.begin();
-    } else {
-      id = *ourId.begin();
-    }
-    if (id >= 0 && (idToInfo[id].services & requestedFlags) == requestedFlags) {
-      ips.insert(idToInfo[id].ip);
+void CAddrShard::Load_(const CAddrInfo &info) {
+  if (info.GetBanTime()) return;
+  int id = idToInfo.insert(info);
+  if (id == -1) return;
+  ipToId.Set(info.ip, id);
+  filter->Set(info.ip, info.lastTry);
+  if (info.ourLastTry) {
+    if (info.IsGood()) {
+      goodId.insert(id);
+      UpdateGood_(id);
     }
-    return;
-  }
-  std::vector<int> goodIdFiltered;
-  for (std::set<int>::const_iterator it = goodId.begin(); it != goodId.end(); it++) {
-    if ((idToInfo[*it].services & requestedFlags) == requestedFlags)
-      goodIdFiltered.push_back(*it);
+    Schedule_(id);
+  } else {
+    unkId[GetCrawlNet(info.ip)].insert(id);
   }
+  nDirty++;
+}
 
-  if (!goodIdFiltered.size())
-    return;
-
-  if (max > goodIdFiltered.size() / 2)
-    max = goodIdFiltered.size() / 2;
-  if (max < 1)
-    max = 1;
+void CAddrShard::GetAnyIP_(set<CNetAddr>& ips, uint64_t requestedFlags) {
+  int id = -1;
+  for (int net = 0; net < NET_MAX && id == -1; net++) {
+    if (ourId[net][TIER_TRACKED].size())
+      id = ourId[net][TIER_TRACKED].GetIds()[0];
+  }
+  for (int net = 0; net < NET_MAX && id == -1; net++) {
+    if (unkId[net].size())
+      id = unkId[net][0];
+  }
+  if (id == -1) return;
+  if ((idToInfo[id].services & requestedFlags) == requestedFlags)
+    ips.insert(idToInfo[id].ip);
+}
 
+void CAddrShard::GetIPs_(set<CNetAddr>& ips, uint64_t requestedFlags, int max, const bool* nets) {
   set<int> ids;
-  while (ids.size() < max) {
-    ids.insert(goodIdFiltered[rand() % goodIdFiltered.size()]);
+  map<uint64_t, CSlotIdSet>::const_iterator mi = mapGoodFiltered.find(requestedFlags);
+  if (requestedFlags == 0 || mi != mapGoodFiltered.end()) {
+    const CSlotIdSet &good = requestedFlags == 0 ? goodId : mi->second;
+    if (good.empty())
+      return;
+    if (max > good.size() / 2)
+      max = good.size() / 2;
+    if (max < 1)
+      max = 1;
+    while (ids.size() < max)
+      ids.insert(good.GetRandom());
+  } else {
+    // no set for these flags: count the good nodes that have them, then
+    // pick among them in a second pass (selection sampling)
+    int nMatch = 0;
+    for (CSlotIdSet::const_iterator it = goodId.begin(); it != goodId.end(); it++) {
+      if ((idToInfo[*it].services & requestedFlags) == requestedFlags)
+        nMatch++;
+    }
+    if (nMatch == 0)
+      return;
+    if (max > nMatch / 2)
+      max = nMatch / 2;
+    if (max < 1)
+      max = 1;
+    for (CSlotIdSet::const_iterator it = goodId.begin(); it != goodId.end() && ids.size() < max; it++) {
+      if ((idToInfo[*it].services & requestedFlags) != requestedFlags)
+        continue;
+      if (rand() % nMatch < max - (int)ids.size())
+        ids.insert(*it);
+      nMatch--;
+    }
   }
   for (set<int>::const_iterator it = ids.begin(); it != ids.end(); it++) {
     CService &ip = idToInfo[*it].ip;
@@ -203,3 +451,203 @@ void CAddrDb::GetIPs_(set<CNetAddr>& ips, uint64_t requestedFlags, int max, cons
       ips.insert(ip);
   }
 }
+
+CAddrDb::CAddrDb() : nNextShard(0) {
+  std::random_device rd;
+  k0 = ((uint64_t)rd() << 32) ^ rd();
+  k1 = ((uint64_t)rd() << 32) ^ rd();
+  for (int i = 0; i < ADDRDB_SHARDS; i++)
+    vShard[i].SetShared(&limiter, &filter);
+  for (int net = 0; net < NET_MAX; net++)
+    vfCrawled[net] = true;
+}
+
+int CAddrDb::GetShard(const CService &ip) const {
+  unsigned char vchKey[18];
+  ip.GetKey(vchKey);
+  return SipHash(k0, k1, vchKey, sizeof(vchKey)) % ADDRDB_SHARDS;
+}
+
+static bool CompareAddrTime(const CAddress *a, const CAddress *b) {
+  if ((CService)*a != (CService)*b)
+    return (CService)*a < (CService)*b;
+  return a->nTime > b->nTime;
+}
+
+// Most of an addr batch is addresses we know already, or repeats within
+// the batch. Both go here, in the caller's thread, so that the lock is only
+// taken for what is left. Add_ still checks everything itself.
+void CAddrDb::Prefilter(const vector<CAddress> &vAddr, vector<CAddress> &vNew) {
+  vector<const CAddress*> vpAddr;
+  vpAddr.reserve(vAddr.size());
+  for (int i=0; i<vAddr.size(); i++) {
+    if (vAddr[i].IsRoutable() && !filter.IsKnown(vAddr[i], vAddr[i].nTime))
+      vpAddr.push_back(&vAddr[i]);
+  }
+  // of repeats, only the newest makes a difference
+  sort(vpAddr.begin(), vpAddr.end(), CompareAddrTime);
+  vector<bool> vfKeep(vAddr.size(), false);
+  for (int i=0; i<vpAddr.size(); i++) {
+    if (i == 0 || (CService)*vpAddr[i] != (CService)*vpAddr[i-1])
+      vfKeep[vpAddr[i] - &vAddr[0]] = true;
+  }
+  vNew.clear();
+  for (int i=0; i<vAddr.size(); i++) {
+    if (vfKeep[i])
+      vNew.push_back(vAddr[i]);
+  }
+}
+
+void CAddrDb::Add(const vector<CAddress> &vAddr, bool fForce) {
+  vector<CAddress> vNew;
+  if (!fForce)
+    Prefilter(vAddr, vNew);
+  const vector<CAddress> &vAdd = fForce ? vAddr : vNew;
+  if (vAdd.empty())
+    return;
+  vector<CAddress> vShardAddr[ADDRDB_SHARDS];
+  for (int i=0; i<vAdd.size(); i++) {
+    if (vfCrawled[GetCrawlNet(vAdd[i])])
+      vShardAddr[GetShard(vAdd[i])].push_back(vAdd[i]);
+  }
+  for (int i = 0; i < ADDRDB_SHARDS; i++) {
+    if (!vShardAddr[i].empty())
+      vShard[i].Add(vShardAddr[i], fForce);
+  }
+}
+
+// Every call starts at another shard. Due revisits are taken from all
+// shards before any new address, so that one shard's new addresses do not
+// go ahead of another's revisits. Within each, an even share is taken from
+// every shard first, and the rest from shards that have not run dry.
+void CAddrDb::GetMany(vector<CServiceResult> &ips, int max, int &wait, int nNet) {
+  unsigned int nStart = nNextShard++;
+  int nShare = (max + ADDRDB_SHARDS - 1) / ADDRDB_SHARDS;
+  // only shards with addresses of nNet say how long to wait
+  int nWait = std::numeric_limits<int>::max();
+  for (int nStage = 0; nStage < 2; nStage++) {
+    bool fRevisitsOnly = nStage == 0;
+    bool vfDry[ADDRDB_SHARDS] = {};
+    for (int nPass = 0; nPass < 2; nPass++) {
+      for (int i = 0; i < ADDRDB_SHARDS && max > 0; i++) {
+        int nShard = (nStart + i) % ADDRDB_SHARDS;
+        if (vfDry[nShard]) continue;
+        int nWant = nPass ? max : std::min(nShare, max);
+        int nShardWait = std::numeric_limits<int>::max();
+        size_t nBefore = ips.size();
+        vShard[nShard].GetMany(ips, nWant, nShardWait, nNet, fRevisitsOnly);
+        max -= ips.size() - nBefore;
+        vfDry[nShard] = ips.size() - nBefore < nWant;
+        nWait = std::min(nWait, nShardWait);
+      }
+    }
+  }
+  if (nWait != std::numeric_limits<int>::max())
+    wait = nWait;
+  else if (ips.empty())
+    wait = 5;
+}
+
+void CAddrDb::GetUnknown(vector<CServiceResult> &ips, int max, int nNet) {
+  unsigned int nStart = nNextShard++;
+  int nShare = (max + ADDRDB_SHARDS - 1) / ADDRDB_SHARDS;
+  bool vfDry[ADDRDB_SHARDS] = {};
+  for (int nPass = 0; nPass < 2; nPass++) {
+    for (int i = 0; i < ADDRDB_SHARDS && max > 0; i++) {
+      int nShard = (nStart + i) % ADDRDB_SHARDS;
+      if (vfDry[nShard]) continue;
+      int nWant = nPass ? max : std::min(nShare, max);
+      size_t nBefore = ips.size();
+      vShard[nShard].GetUnknown(ips, nWant, nNet);
+      max -= ips.size() - nBefore;
+      vfDry[nShard] = ips.size() - nBefore < nWant;
+    }
+  }
+}
+
+void CAddrDb::ResultMany(const vector<CServiceResult> &ips) {
+  vector<CServiceResult> vShardIps[ADDRDB_SHARDS];
+  for (int i=0; i<ips.size(); i++)
+    vShardIps[GetShard(ips[i].service)].push_back(ips[i]);
+  for (int i = 0; i < ADDRDB_SHARDS; i++) {
+    if (!vShardIps[i].empty())
+      vShard[i].ResultMany(vShardIps[i]);
+  }
+}
+
+void CAddrDb::GetStats(CAddrDbStats &stats) {
+  for (int i = 0; i < ADDRDB_SHARDS; i++) {
+    CAddrDbStats shard;
+    vShard[i].GetStats(shard);
+    if (i == 0) {
+      stats = shard;
+      continue;
+    }
+    stats.nBanned += shard.nBanned;
+    stats.nAvail += shard.nAvail;
+    stats.nTracked += shard.nTracked;
+    stats.nNew += shard.nNew;
+    stats.nGood += shard.nGood;
+    stats.nAge = std::max(stats.nAge, shard.nAge);
+    for (int tier = 0; tier < TIER_UNKNOWN; tier++) {
+      stats.nVisits[tier] += shard.nVisits[tier];
+      stats.nLateVisits[tier] += shard.nLateVisits[tier];
+      stats.fOverdue[tier] |= shard.fOverdue[tier];
+    }
+    for (int net = 0; net < NET_MAX; net++) {
+      stats.nNetGood[net] += shard.nNetGood[net];
+      stats.nNetAvail[net] += shard.nNetAvail[net];
+      stats.nNetActive[net] += shard.nNetActive[net];
+    }
+  }
+}
+
+void CAddrDb::ResetIgnores() {
+  for (int i = 0; i < ADDRDB_SHARDS; i++)
+    vShard[i].ResetIgnores();
+}
+
+vector<CAddrReport> CAddrDb::GetAll() {
+  vector<CAddrReport> ret;
+  for (int i = 0; i < ADDRDB_SHARDS; i++) {
+    vector<CAddrReport> shard = vShard[i].GetAll();
+    ret.insert(ret.end(), shard.begin(), shard.end());
+  }
+  return ret;
+}
+
+// The good nodes are spread over the shards, so each shard is asked for
+// its share of the answer, drawn in proportion to its good nodes.
+void CAddrDb::GetIPs(set<CNetAddr>& ips, uint64_t requestedFlags, int max, const bool *nets) {
+  int vnGood[ADDRDB_SHARDS];
+  int nGood = 0, nAnyGood = 0;
+  for (int i = 0; i < ADDRDB_SHARDS; i++) {
+    vnGood[i] = vShard[i].GetGoodCount(requestedFlags);
+    nGood += vnGood[i];
+    nAnyGood += requestedFlags ? vShard[i].GetGoodCount(0) : vnGood[i];
+  }
+  if (nAnyGood == 0) {
+    // no good nodes at all: one node from the first shard that has any
+    for (int i = 0; i < ADDRDB_SHARDS && ips.empty(); i++)
+      vShard[i].GetAnyIP(ips, requestedFlags);
+    return;
+  }
+  if (nGood == 0)
+    return;
+  if (max > nGood / 2)
+    max = nGood / 2;
+  if (max < 1)
+    max = 1;
+  int vnWant[ADDRDB_SHARDS] = {};
+  for (int n = 0; n < max; n++) {
+    int r = rand() % nGood;
+    int i = 0;
+    while (r >= vnGood[i])
+      r -= vnGood[i++];
+    vnWant[i]++;
+  }
+  for (int i = 0; i < ADDRDB_SHARDS; i++) {
+    if (vnWant[i])
+      vShard[i].GetIPs(ips, requestedFlags, vnWant[i], nets);
+  }
+}
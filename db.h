@@ -1,17 +1,48 @@
 #include <stdint.h>
 #include <math.h>
 
+#include <algorithm>
+#include <atomic>
 #include <set>
 #include <map>
 #include <vector>
 #include <deque>
 
+#include "addrfilter.h"
+#include "addrindex.h"
+#include "grouplimit.h"
 #include "netbase.h"
 #include "protocol.h"
+#include "slotmap.h"
+#include "timewheel.h"
 #include "util.h"
 
 #define MIN_RETRY 1000
 
+#define MAX_FLIP_PROBES 3
+
+#define ADDRDB_SHARDS 16
+
+// nodes are revisited by tier, each with its own target interval
+enum NodeTier {
+  TIER_GOOD = 0,     // good nodes, which DNS answers come from
+  TIER_TRACKED,      // other tried nodes
+  TIER_UNKNOWN,      // never tried; best effort
+
+  TIER_MAX,
+};
+
+// revisit target per tier in seconds; 0 for best effort
+extern int64 nTierTarget[TIER_MAX];
+
+// each network is crawled from its own queues, by its own crawlers, so that
+// slow ones (Tor, through a proxy) cannot hold up the others; unroutable
+// addresses, which only get in by hand, go with IPv4
+static inline int GetCrawlNet(const CNetAddr &addr) {
+  int nNet = addr.GetNetwork();
+  return nNet == NET_UNROUTABLE ? NET_IPV4 : nNet;
+}
+
 #define REQUIRE_VERSION 70001
 
 extern int nMinimumHeight;
@@ -20,6 +51,22 @@ static inline int GetRequireHeight(const bool testnet = fTestNet)
     return nMinimumHeight ? nMinimumHeight : (testnet ? 500000 : 350000);
 }
 
+// how a probe ended; failures of different kinds are retried differently
+enum ProbeOutcome {
+  OUTCOME_GOOD = 0,
+  OUTCOME_REFUSED,   // connection refused, or no route: fast, and definitive
+  OUTCOME_TIMEOUT,   // no answer to the connect: slow, and ambiguous
+  OUTCOME_RESET,     // connected, then closed or reset before the probe completed
+  OUTCOME_SILENT,    // connected, but no answer in time
+  OUTCOME_PROTOCOL,  // misbehaved, and banned
+  OUTCOME_LOCAL,     // out of file descriptors or ports; says nothing about the node
+
+  OUTCOME_MAX,
+};
+
+// outcome of a connection attempt that failed with errno nError
+int GetConnectOutcome(int nError);
+
 std::string static inline ToString(const CService &ip) {
   std::string str = ip.ToString();
   while (str.size() < 22) str += ' ';
@@ -71,6 +118,8 @@ private:
   int64 ourLastTry;
   int64 ourLastSuccess;
   int64 ignoreTill;
+  unsigned char outcome; // of the last probe
+  int failures;          // probes in a row that failed with that outcome
   CAddrStat stat2H;
   CAddrStat stat8H;
   CAddrStat stat1D;
@@ -82,7 +131,7 @@ private:
   int success;
   std::string clientSubVersion;
 public:
-  CAddrInfo() : services(0), lastTry(0), ourLastTry(0), ourLastSuccess(0), ignoreTill(0), clientVersion(0), blocks(0), total(0), success(0) {}
+  CAddrInfo() : services(0), lastTry(0), ourLastTry(0), ourLastSuccess(0), ignoreTill(0), outcome(OUTCOME_GOOD), failures(0), clientVersion(0), blocks(0), total(0), success(0) {}
   
   CAddrReport GetReport() const {
     CAddrReport ret;
@@ -128,19 +177,31 @@ public:
   }
   int GetIgnoreTime() const {
     if (IsGood()) return 0;
-    if (stat1M.reliability - stat1M.weight + 1.0 < 0.20 && stat1M.count > 2) { return 10*86400; }
-    if (stat1W.reliability - stat1W.weight + 1.0 < 0.16 && stat1W.count > 2)  { return 3*86400; }
-    if (stat1D.reliability - stat1D.weight + 1.0 < 0.12 && stat1D.count > 2)  { return 8*3600; }
-    if (stat8H.reliability - stat8H.weight + 1.0 < 0.08 && stat8H.count > 2)  { return 2*3600; }
-    return 0;
+    int ign = GetBackoffTime();
+    if (stat1M.reliability - stat1M.weight + 1.0 < 0.20 && stat1M.count > 2) { return std::max(ign, 10*86400); }
+    if (stat1W.reliability - stat1W.weight + 1.0 < 0.16 && stat1W.count > 2)  { return std::max(ign, 3*86400); }
+    if (stat1D.reliability - stat1D.weight + 1.0 < 0.12 && stat1D.count > 2)  { return std::max(ign, 8*3600); }
+    if (stat8H.reliability - stat8H.weight + 1.0 < 0.08 && stat8H.count > 2)  { return std::max(ign, 2*3600); }
+    return ign;
   }
+  // exponential backoff after failures in a row, depending on how they failed
+  int GetBackoffTime() const;
   
-  void Update(bool good);
+  void Update(int nOutcome);
+  void Update(int nOutcome, int64 now);
+
+  // how many more probes nInterval apart, all with the result that
+  // contradicts IsGood(), it takes to change it (MAX_FLIP_PROBES + 1 if more)
+  int GetProbesToFlip(int64 nInterval) const;
+  // the chance that the coming probes change IsGood(), at the node's own
+  // success rate
+  double GetFlipChance(int64 nInterval) const;
   
+  friend class CAddrShard;
   friend class CAddrDb;
   
   IMPLEMENT_SERIALIZE (
-    unsigned char version = 4;
+    unsigned char version = 5;
     READWRITE(version);
     READWRITE(ip);
     READWRITE(services);
@@ -168,6 +229,10 @@ public:
           READWRITE(blocks);
       if (version >= 4)
           READWRITE(ourLastSuccess);
+      if (version >= 5) {
+          READWRITE(outcome);
+          READWRITE(failures);
+      }
     }
   )
 };
@@ -180,6 +245,12 @@ public:
   int nNew;
   int nGood;
   int nAge;
+  int64 nVisits[TIER_UNKNOWN];      // revisits so far
+  int64 nLateVisits[TIER_UNKNOWN];  // of which past the tier's target
+  bool fOverdue[TIER_UNKNOWN];      // a node is waiting past the tier's target now
+  int nNetGood[NET_MAX];            // per crawl network
+  int nNetAvail[NET_MAX];
+  int nNetActive[NET_MAX];
 };
 
 struct CServiceResult {
@@ -191,6 +262,10 @@ struct CServiceResult {
     int nClientV;
     std::string strClientV;
     int64 ourLastSuccess;
+    int nPrevClientV; // client version seen when this node was last reachable
+    bool fPrevGood; // whether this node was good when it was handed out
+    int nError; // errno of the failed connection attempt, 0 if it connected
+    int nOutcome; // ProbeOutcome
 };
 
 //             seen nodes
@@ -201,110 +276,140 @@ struct CServiceResult {
 //              /           \
 //     (d) good nodes   (c) non-good nodes 
 
-class CAddrDb {
+// One partition of the database, with its own lock and queues; CAddrDb
+// sends every address to the same shard.
+class CAddrShard {
 private:
   mutable CCriticalSection cs;
-  int nId; // number of address id's
-  std::map<int, CAddrInfo> idToInfo; // map address id to address info (b,c,d,e)
-  std::map<CService, int> ipToId; // map ip to id (b,c,d,e)
-  std::deque<int> ourId; // sequence of tried nodes, in order we have tried connecting to them (c,d)
-  std::set<int> unkId; // set of nodes not yet tried (b)
-  std::set<int> goodId; // set of good nodes  (d, good e)
+  CSlotMap<CAddrInfo> idToInfo; // map address id to address info (b,c,d,e)
+  CAddrIndex ipToId; // map ip to id (b,c,d,e)
+  CTimingWheel ourId[NET_MAX][TIER_UNKNOWN]; // tried nodes per network and tier, by when they are due to be tried again (c,d)
+  int64 nVisits[TIER_UNKNOWN];
+  int64 nLateVisits[TIER_UNKNOWN];
+  CSlotIdSet unkId[NET_MAX]; // set of nodes not yet tried, per network (b)
+  CTimingWheel unkHeld[NET_MAX]; // nodes not yet tried whose netgroup was busy, by when to look again (b)
+  int nActive[NET_MAX]; // nodes being tried, per network (e)
+  CSlotIdSet goodId; // set of good nodes  (d, good e)
+  std::map<uint64_t, CSlotIdSet> mapGoodFiltered; // good nodes with all of the service flags, per DNS filter (d, good e)
   int nDirty;
+  CGroupLimiter *limiter; // shared by all shards
+  CAddrFilter *filter;    // shared by all shards
   
 protected:
   // internal routines that assume proper locks are acquired
   void Add_(const CAddress &addr, bool force);   // add an address
-  bool Get_(CServiceResult &ip, int& wait);      // get an IP to test (must call Good_, Bad_, or Skipped_ on result afterwards)
-  bool GetMany_(std::vector<CServiceResult> &ips, int max, int& wait);
+  bool Get_(CServiceResult &ip, int& wait, int nNet, bool fRevisitsOnly = false); // get an IP in crawl network nNet to test (must call Good_, Bad_, or Skipped_ on result afterwards); wait is left alone if there is none of nNet at all
+  bool GetUnknown_(CServiceResult &ip, int nNet); // like Get_, but only returns never tried IPs
+  bool PopAdmitted_(CTimingWheel &wheel, int64 now, int &id); // take a due IP whose netgroup has room
+  bool PopUnknown_(int64 now, int &id, int nNet); // take a never tried IP whose netgroup has room
+  void Fill_(int id, CServiceResult &ip);        // describe an IP to test in ip, and count it as active
+  void Finish_(const CService &ip);              // an IP from Fill_ is no longer active
+  int64 GetDue_(const CAddrInfo &info, int tier); // when a tried IP is due to be tried again
+  int64 GetDeadline_(const CAddrInfo &info, int tier); // when it is late for its tier's target
+  void Schedule_(int id, int64 nNotBefore = 0);  // queue a tried IP in its tier
+  int GetTrackedCount_(int nNet) const { return ourId[nNet][TIER_GOOD].size() + ourId[nNet][TIER_TRACKED].size(); }
+  int GetUnknownCount_(int nNet) const { return unkId[nNet].size() + unkHeld[nNet].size(); }
+  int GetTrackedCount_() const;
+  int GetUnknownCount_() const;
+  bool IsTracked_(int id) const;                 // whether a tried IP is queued
   void Good_(const CService &ip, int clientV, std::string clientSV, int blocks, uint64_t services); // mark an IP as good (must have been returned by Get_)
-  void Bad_(const CService &ip, int ban);  // mark an IP as bad (and optionally ban it) (must have been returned by Get_)
+  void Bad_(const CService &ip, int ban, int outcome = OUTCOME_SILENT);  // mark an IP as bad (and optionally ban it) (must have been returned by Get_)
   void Skipped_(const CService &ip);       // mark an IP as skipped (must have been returned by Get_)
   int Lookup_(const CService &ip);         // look up id of an IP
-  void GetIPs_(std::set<CNetAddr>& ips, uint64_t requestedFlags, int max, const bool *nets); // get a random set of IPs (shared lock only)
+  void UpdateGood_(int id);                // bring the filtered good sets in line with goodId and the IP's services
+  void GetIPs_(std::set<CNetAddr>& ips, uint64_t requestedFlags, int max, const bool *nets); // get a random set of good IPs (shared lock only)
+  void GetAnyIP_(std::set<CNetAddr>& ips, uint64_t requestedFlags); // get a tracked or new IP, for when no shard has a good one (shared lock only)
+  void Load_(const CAddrInfo &info);       // take an IP read from dnsseed.dat
+
+  friend class CAddrDb;
 
 public:
   std::map<CService, time_t> banned; // nodes that are banned, with their unban time (a)
 
+  CAddrShard();
+  void SetShared(CGroupLimiter *limiterIn, CAddrFilter *filterIn) {
+    limiter = limiterIn;
+    filter = filterIn;
+  }
+
   void GetStats(CAddrDbStats &stats) {
     SHARED_CRITICAL_BLOCK(cs) {
       stats.nBanned = banned.size();
       stats.nAvail = idToInfo.size();
-      stats.nTracked = ourId.size();
+      stats.nTracked = GetTrackedCount_();
       stats.nGood = goodId.size();
-      stats.nNew = unkId.size();
-      stats.nAge = time(NULL) - idToInfo[ourId[0]].ourLastTry;
+      stats.nNew = GetUnknownCount_();
+      stats.nAge = 0;
+      int64 now = time(NULL);
+      for (int tier = 0; tier < TIER_UNKNOWN; tier++) {
+        stats.nVisits[tier] = nVisits[tier];
+        stats.nLateVisits[tier] = nLateVisits[tier];
+        stats.fOverdue[tier] = false;
+      }
+      for (int net = 0; net < NET_MAX; net++) {
+        stats.nNetGood[net] = ourId[net][TIER_GOOD].size();
+        stats.nNetAvail[net] = GetTrackedCount_(net) + GetUnknownCount_(net) + nActive[net];
+        stats.nNetActive[net] = nActive[net];
+        for (int tier = 0; tier < TIER_UNKNOWN; tier++) {
+          int id;
+          int64 nDue;
+          if (ourId[net][tier].GetNext(id, nDue)) {
+            const CAddrInfo &info = idToInfo[id];
+            stats.nAge = std::max(stats.nAge, (int)(now - info.ourLastTry));
+            stats.fOverdue[tier] |= now > GetDeadline_(info, tier);
+          }
+        }
+      }
     }
   }
 
   void ResetIgnores() {
-      for (std::map<int, CAddrInfo>::iterator it = idToInfo.begin(); it != idToInfo.end(); it++) {
-           (*it).second.ignoreTill = 0;
+      for (size_t i = 0; i < idToInfo.capacity(); i++) {
+           int id = idToInfo.GetId(i);
+           if (id == -1) continue;
+           idToInfo[id].ignoreTill = 0;
+           if (IsTracked_(id))
+               Schedule_(id);
       }
   }
   
   std::vector<CAddrReport> GetAll() {
     std::vector<CAddrReport> ret;
     SHARED_CRITICAL_BLOCK(cs) {
-      for (std::deque<int>::const_iterator it = ourId.begin(); it != ourId.end(); it++) {
-        const CAddrInfo &info = idToInfo[*it];
-        if (info.success > 0) {
-          ret.push_back(info.GetReport());
+      for (int net = 0; net < NET_MAX; net++) {
+        for (int tier = 0; tier < TIER_UNKNOWN; tier++) {
+          for (CSlotIdSet::const_iterator it = ourId[net][tier].GetIds().begin(); it != ourId[net][tier].GetIds().end(); it++) {
+            const CAddrInfo &info = idToInfo[*it];
+            if (info.success > 0) {
+              ret.push_back(info.GetReport());
+            }
+          }
         }
       }
     }
     return ret;
   }
   
-  // serialization code
-  // format:
-  //   nVersion (0 for now)
-  //   n (number of ips in (b,c,d))
-  //   CAddrInfo[n]
-  //   banned
-  // acquires a shared lock (this does not suffice for read mode, but we assume that only happens at startup, single-threaded)
-  // this way, dumping does not interfere with GetIPs_, which is called from the DNS thread
-  IMPLEMENT_SERIALIZE (({
-    int nVersion = 0;
-    READWRITE(nVersion);
-    SHARED_CRITICAL_BLOCK(cs) {
-      if (fWrite) {
-        CAddrDb *db = const_cast<CAddrDb*>(this);
-        int n = ourId.size() + unkId.size();
-        READWRITE(n);
-        for (std::deque<int>::const_iterator it = ourId.begin(); it != ourId.end(); it++) {
-          std::map<int, CAddrInfo>::iterator ci = db->idToInfo.find(*it);
-          READWRITE((*ci).second);
-        }
-        for (std::set<int>::const_iterator it = unkId.begin(); it != unkId.end(); it++) {
-          std::map<int, CAddrInfo>::iterator ci = db->idToInfo.find(*it);
-          READWRITE((*ci).second);
-        }
-      } else {
-        CAddrDb *db = const_cast<CAddrDb*>(this);
-        db->nId = 0;
-        int n = 0;
-        READWRITE(n);
-        for (int i=0; i<n; i++) {
-          CAddrInfo info;
-          READWRITE(info);
-          if (!info.GetBanTime()) {
-            int id = db->nId++;
-            db->idToInfo[id] = info;
-            db->ipToId[info.ip] = id;
-            if (info.ourLastTry) {
-              db->ourId.push_back(id);
-              if (info.IsGood()) db->goodId.insert(id);
-            } else {
-              db->unkId.insert(id);
-            }
-          }
-        }
-        db->nDirty++;
+  // keep a set of the good nodes for each of these service flag filters,
+  // which GetIPs then samples from directly
+  void SetFilters(const std::set<uint64_t> &setFlags) {
+    CRITICAL_BLOCK(cs) {
+      mapGoodFiltered.clear();
+      for (std::set<uint64_t>::const_iterator it = setFlags.begin(); it != setFlags.end(); it++) {
+        if (*it) mapGoodFiltered[*it];
       }
-      READWRITE(banned);
+      for (CSlotIdSet::const_iterator it = goodId.begin(); it != goodId.end(); it++)
+        UpdateGood_(*it);
     }
-  });)
+  }
+
+  void ClearBanned() {
+    CRITICAL_BLOCK(cs) {
+      for (std::map<CService, time_t>::const_iterator it = banned.begin(); it != banned.end(); it++)
+        filter->Erase(it->first);
+      banned.clear();
+    }
+  }
 
   void Add(const CAddress &addr, bool fForce = false) {
     CRITICAL_BLOCK(cs)
@@ -323,20 +428,26 @@ public:
     CRITICAL_BLOCK(cs)
       Skipped_(addr);
   }
-  void Bad(const CService &addr, int ban = 0) {
+  void Bad(const CService &addr, int ban = 0, int outcome = OUTCOME_SILENT) {
     CRITICAL_BLOCK(cs)
-      Bad_(addr, ban);
+      Bad_(addr, ban, outcome);
   }
-  bool Get(CServiceResult &ip, int& wait) {
-    CRITICAL_BLOCK(cs)
-      return Get_(ip, wait);
-    return false;
+  void GetMany(std::vector<CServiceResult> &ips, int max, int& wait, int nNet, bool fRevisitsOnly = false) {
+    CRITICAL_BLOCK(cs) {
+      while (max > 0) {
+          CServiceResult ip = {};
+          if (!Get_(ip, wait, nNet, fRevisitsOnly))
+              return;
+          ips.push_back(ip);
+          max--;
+      }
+    }
   }
-  void GetMany(std::vector<CServiceResult> &ips, int max, int& wait) {
+  void GetUnknown(std::vector<CServiceResult> &ips, int max, int nNet) {
     CRITICAL_BLOCK(cs) {
       while (max > 0) {
           CServiceResult ip = {};
-          if (!Get_(ip, wait))
+          if (!GetUnknown_(ip, nNet))
               return;
           ips.push_back(ip);
           max--;
@@ -348,8 +459,10 @@ public:
       for (int i=0; i<ips.size(); i++) {
         if (ips[i].fGood) {
           Good_(ips[i].service, ips[i].nClientV, ips[i].strClientV, ips[i].nHeight, ips[i].services);
+        } else if (ips[i].nOutcome == OUTCOME_LOCAL) {
+          Skipped_(ips[i].service);
         } else {
-          Bad_(ips[i].service, ips[i].nBanTime);
+          Bad_(ips[i].service, ips[i].nBanTime, ips[i].nOutcome);
         }
       }
     }
@@ -358,4 +471,162 @@ public:
     SHARED_CRITICAL_BLOCK(cs)
       GetIPs_(ips, requestedFlags, max, nets);
   }
+  void GetAnyIP(std::set<CNetAddr>& ips, uint64_t requestedFlags) {
+    SHARED_CRITICAL_BLOCK(cs)
+      GetAnyIP_(ips, requestedFlags);
+  }
+  // how many good nodes GetIPs draws from for these flags
+  int GetGoodCount(uint64_t requestedFlags) const {
+    SHARED_CRITICAL_BLOCK(cs) {
+      std::map<uint64_t, CSlotIdSet>::const_iterator mi = mapGoodFiltered.find(requestedFlags);
+      return requestedFlags == 0 || mi == mapGoodFiltered.end() ? goodId.size() : mi->second.size();
+    }
+    return 0;
+  }
+};
+
+
+// The database, split by a hash of the address into shards that each have
+// their own lock and queues, so that crawlers mostly do not wait on each
+// other. Crawlers take addresses from every shard in turn; stats, dumps and
+// DNS answers are merged across them.
+class CAddrDb {
+private:
+  CAddrShard vShard[ADDRDB_SHARDS];
+  CGroupLimiter limiter; // netgroups span shards; has a lock of its own
+  CAddrFilter filter; // known and banned IPs, to weed out addr messages without a lock
+  uint64_t k0, k1; // SipHash key that picks the shard
+  bool vfCrawled[NET_MAX]; // networks that are crawled; addresses of others are not taken
+  std::atomic<unsigned int> nNextShard; // where the next GetMany or GetUnknown starts
+
+  // shared locks on all shards at once, taken in order and released when
+  // it goes out of scope
+  class CAllShardsBlock {
+  private:
+    const CAddrShard *vShard;
+  public:
+    CAllShardsBlock(const CAddrShard *vShardIn) : vShard(vShardIn) {
+      for (int i = 0; i < ADDRDB_SHARDS; i++)
+        vShard[i].cs.Enter(true);
+    }
+    ~CAllShardsBlock() {
+      for (int i = ADDRDB_SHARDS - 1; i >= 0; i--)
+        vShard[i].cs.Leave();
+    }
+  };
+
+  int GetShard(const CService &ip) const;
+  void Prefilter(const std::vector<CAddress> &vAddr, std::vector<CAddress> &vNew); // drop what Add_ would ignore (no lock needed)
+
+public:
+  CAddrDb();
+
+  void GetStats(CAddrDbStats &stats);
+  void ResetIgnores();
+  std::vector<CAddrReport> GetAll();
+
+  // serialization code
+  // format:
+  //   nVersion (0 for now)
+  //   n (number of ips in (b,c,d))
+  //   CAddrInfo[n]
+  //   banned
+  // acquires a shared lock on all shards at once, so that n matches what
+  // follows (this does not suffice for read mode, but we assume that only
+  // happens at startup, single-threaded)
+  // this way, dumping does not interfere with GetIPs_, which is called from the DNS thread
+  IMPLEMENT_SERIALIZE (({
+    int nVersion = 0;
+    READWRITE(nVersion);
+    CAddrDb *db = const_cast<CAddrDb*>(this);
+    if (fWrite) {
+      CAllShardsBlock block(vShard);
+      int n = 0;
+      std::map<CService, time_t> banned;
+      for (int i = 0; i < ADDRDB_SHARDS; i++) {
+        n += vShard[i].GetTrackedCount_() + vShard[i].GetUnknownCount_();
+        banned.insert(vShard[i].banned.begin(), vShard[i].banned.end());
+      }
+      READWRITE(n);
+      for (int i = 0; i < ADDRDB_SHARDS; i++) {
+        CAddrShard &shard = db->vShard[i];
+        for (int net = 0; net < NET_MAX; net++) {
+          for (int tier = 0; tier < TIER_UNKNOWN; tier++) {
+            for (CSlotIdSet::const_iterator it = shard.ourId[net][tier].GetIds().begin(); it != shard.ourId[net][tier].GetIds().end(); it++) {
+              READWRITE(shard.idToInfo[*it]);
+            }
+          }
+        }
+        for (int net = 0; net < NET_MAX; net++) {
+          for (CSlotIdSet::const_iterator it = shard.unkId[net].begin(); it != shard.unkId[net].end(); it++) {
+            READWRITE(shard.idToInfo[*it]);
+          }
+          for (CSlotIdSet::const_iterator it = shard.unkHeld[net].GetIds().begin(); it != shard.unkHeld[net].GetIds().end(); it++) {
+            READWRITE(shard.idToInfo[*it]);
+          }
+        }
+      }
+      READWRITE(banned);
+    } else {
+      int n = 0;
+      READWRITE(n);
+      for (int i=0; i<n; i++) {
+        CAddrInfo info;
+        READWRITE(info);
+        if (info.ourLastTry || db->vfCrawled[GetCrawlNet(info.ip)])
+          db->vShard[db->GetShard(info.ip)].Load_(info);
+      }
+      std::map<CService, time_t> banned;
+      READWRITE(banned);
+      for (std::map<CService, time_t>::const_iterator it = banned.begin(); it != banned.end(); it++) {
+        db->vShard[db->GetShard(it->first)].banned[it->first] = it->second;
+        db->filter.Set(it->first, it->second);
+      }
+    }
+  });)
+
+  // keep a set of the good nodes for each of these service flag filters,
+  // which GetIPs then samples from directly
+  void SetFilters(const std::set<uint64_t> &setFlags) {
+    for (int i = 0; i < ADDRDB_SHARDS; i++)
+      vShard[i].SetFilters(setFlags);
+  }
+
+  void ClearBanned() {
+    for (int i = 0; i < ADDRDB_SHARDS; i++)
+      vShard[i].ClearBanned();
+  }
+
+  // only take addresses of the networks in pfCrawled (by crawl network) from
+  // now on, and from dnsseed.dat only those of others that were tried before;
+  // untried ones would never be dequeued
+  void SetCrawledNets(const bool *pfCrawled) {
+    for (int net = 0; net < NET_MAX; net++)
+      vfCrawled[net] = pfCrawled[net];
+  }
+
+  // at most nPerMinute connection attempts and nMaxActive probes at once per
+  // netgroup; 0 for no limit
+  void SetGroupLimits(int nPerMinute, int nMaxActive) {
+    limiter.SetLimits(nPerMinute, nMaxActive);
+  }
+
+  void Add(const CAddress &addr, bool fForce = false) {
+    if (vfCrawled[GetCrawlNet(addr)])
+      vShard[GetShard(addr)].Add(addr, fForce);
+  }
+  void Add(const std::vector<CAddress> &vAddr, bool fForce = false);
+  void Good(const CService &addr, int clientVersion, std::string clientSubVersion, int blocks, uint64_t services) {
+    vShard[GetShard(addr)].Good(addr, clientVersion, clientSubVersion, blocks, services);
+  }
+  void Skipped(const CService &addr) {
+    vShard[GetShard(addr)].Skipped(addr);
+  }
+  void Bad(const CService &addr, int ban = 0, int outcome = OUTCOME_SILENT) {
+    vShard[GetShard(addr)].Bad(addr, ban, outcome);
+  }
+  void GetMany(std::vector<CServiceResult> &ips, int max, int& wait, int nNet);
+  void GetUnknown(std::vector<CServiceResult> &ips, int max, int nNet);
+  void ResultMany(const std::vector<CServiceResult> &ips);
+  void GetIPs(std::set<CNetAddr>& ips, uint64_t requestedFlags, int max, const bool *nets);
 };
@@ -0,0 +1,77 @@
+#include <math.h>
+
+#include "grouplimit.h"
+
+#define GROUP_RETRY 5          // seconds to wait for a busy group
+#define MIN_SWEEP 4096
+
+using namespace std;
+
+CGroupLimiter::CGroupLimiter() : dRate(0), dBurst(0), nMaxActive(0), nSweep(MIN_SWEEP) {}
+
+void CGroupLimiter::SetLimits(int nPerMinute, int nMaxActiveIn) {
+  CRITICAL_BLOCK(cs) {
+    dRate = nPerMinute / 60.0;
+    dBurst = std::max(nPerMinute / 4.0, 1.0);
+    nMaxActive = nMaxActiveIn;
+  }
+}
+
+void CGroupLimiter::Refill(CGroupState &group, int64 now) {
+  if (now > group.nRefill) {
+    group.dTokens = std::min(group.dTokens + (now - group.nRefill) * dRate, dBurst);
+    group.nRefill = now;
+  }
+}
+
+// forget groups with nothing in flight and a full bucket, which are no
+// different from groups never seen
+void CGroupLimiter::Sweep(int64 now) {
+  if (mapGroup.size() < nSweep) return;
+  for (map<vector<unsigned char>, CGroupState>::iterator it = mapGroup.begin(); it != mapGroup.end();) {
+    Refill(it->second, now);
+    if (it->second.nActive == 0 && (dRate == 0 || it->second.dTokens >= dBurst) && it->second.nBooked <= now)
+      mapGroup.erase(it++);
+    else
+      it++;
+  }
+  nSweep = std::max(mapGroup.size() * 2, (size_t)MIN_SWEEP);
+}
+
+bool CGroupLimiter::Start(const CNetAddr &addr, int64 now, int64 &nRetry) {
+  if (!IsEnabled()) return true;
+  vector<unsigned char> vchGroup = addr.GetGroup();
+  CRITICAL_BLOCK(cs) {
+    Sweep(now);
+    map<vector<unsigned char>, CGroupState>::iterator it = mapGroup.find(vchGroup);
+    if (it == mapGroup.end()) {
+      CGroupState group = {dBurst, now, 0, 0};
+      it = mapGroup.insert(make_pair(vchGroup, group)).first;
+    }
+    CGroupState &group = it->second;
+    Refill(group, now);
+    bool fTokens = dRate == 0 || group.dTokens >= 1;
+    bool fRoom = nMaxActive == 0 || group.nActive < nMaxActive;
+    if (fTokens && fRoom) {
+      if (dRate > 0) group.dTokens -= 1;
+      group.nActive++;
+      return true;
+    }
+    // hand out retries one token apart, rather than all at the same second
+    int64 nNext = now + (fTokens ? GROUP_RETRY : (int64)ceil((1 - group.dTokens) / dRate));
+    if (dRate > 0)
+      nNext = std::max(nNext, group.nBooked + (int64)ceil(1 / dRate));
+    group.nBooked = nRetry = nNext;
+  }
+  return false;
+}
+
+void CGroupLimiter::Finish(const CNetAddr &addr) {
+  if (!IsEnabled()) return;
+  vector<unsigned char> vchGroup = addr.GetGroup();
+  CRITICAL_BLOCK(cs) {
+    map<vector<unsigned char>, CGroupState>::iterator it = mapGroup.find(vchGroup);
+    if (it != mapGroup.end() && it->second.nActive > 0)
+      it->second.nActive--;
+  }
+}
@@ -0,0 +1,50 @@
+#ifndef _GROUPLIMIT_H_
+#define _GROUPLIMIT_H_ 1
+
+#include <map>
+#include <vector>
+
+#include "netbase.h"
+#include "util.h"
+
+// Connection attempts per netgroup (/16 for IPv4, /32 for IPv6), so that a
+// crawl does not hit one network with a burst of connections. Each group
+// has a token bucket for new attempts and a cap on probes in flight. A
+// group that is out of either is told when to come back; addresses in
+// other groups are not held up by it.
+//
+// A netgroup spans all of CAddrDb's shards, so this has a lock of its own,
+// which is taken under a shard's lock and never the other way around.
+class CGroupLimiter {
+private:
+  struct CGroupState {
+    double dTokens;
+    int64 nRefill;  // when dTokens was last brought up to date
+    int64 nBooked;  // latest retry handed out, so the ones held back trickle in
+    int nActive;
+  };
+
+  double dRate;     // tokens per second; 0 for no limit
+  double dBurst;
+  int nMaxActive;   // 0 for no limit
+  size_t nSweep;    // group count at which to drop idle groups
+  std::map<std::vector<unsigned char>, CGroupState> mapGroup;
+  CCriticalSection cs;
+
+  void Refill(CGroupState &group, int64 now);
+  void Sweep(int64 now);
+
+public:
+  CGroupLimiter();
+
+  // nPerMinute attempts per group per minute, bursts of a quarter of that
+  void SetLimits(int nPerMinute, int nMaxActiveIn);
+  bool IsEnabled() const { return dRate > 0 || nMaxActive > 0; }
+
+  // start an attempt on addr now, or say when to try again in nRetry
+  bool Start(const CNetAddr &addr, int64 now, int64 &nRetry);
+  // an attempt that was started ended
+  void Finish(const CNetAddr &addr);
+};
+
+#endif
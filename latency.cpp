@@ -0,0 +1,99 @@
+#include <math.h>
+
+#include "latency.h"
+
+#define SAFETY_FACTOR 3.0
+#define MIN_TIMEOUT 1000         // milliseconds
+#define MIN_NET_SAMPLES 100
+#define MIN_GROUP_SAMPLES 8
+#define MAX_NET_SAMPLES 4096.0   // older samples fade out past this
+#define MAX_GROUPS 100000
+#define EXPLORE_EVERY 16         // waits that get the static timeout regardless
+
+using namespace std;
+
+CLatencyStats latency;
+
+CLatencyStats::CGroupLatency::CGroupLatency() {
+  for (int i = 0; i < LATENCY_KINDS; i++) {
+    dMean[i] = 0;
+    dDev[i] = 0;
+    nCount[i] = 0;
+  }
+}
+
+CLatencyStats::CLatencyStats() : fEnabled(true), nRequests(0) {
+  for (int n = 0; n < NET_MAX; n++) {
+    for (int k = 0; k < LATENCY_KINDS; k++) {
+      vdTotal[n][k] = 0;
+      for (int i = 0; i < BUCKETS; i++)
+        vdBucket[n][k][i] = 0;
+    }
+  }
+}
+
+int CLatencyStats::GetBucket(int64 nMillis) {
+  int nBucket = (int)(4 * log2((double)std::max(nMillis, (int64)0) + 1));
+  return std::min(nBucket, BUCKETS - 1);
+}
+
+// must hold cs; returns the upper end of the bucket holding the percentile
+double CLatencyStats::GetPercentile(int nNet, int nKind, double dFraction) {
+  double dAbove = vdTotal[nNet][nKind] * (1 - dFraction);
+  int i = BUCKETS - 1;
+  for (; i > 0; i--) {
+    dAbove -= vdBucket[nNet][nKind][i];
+    if (dAbove < 0) break;
+  }
+  return pow(2, (i + 1) / 4.0) - 1;
+}
+
+void CLatencyStats::Record(const CNetAddr &addr, int nKind, int64 nMillis) {
+  int nNet = addr.GetNetwork();
+  vector<unsigned char> vchGroup = addr.GetGroup();
+  CRITICAL_BLOCK(cs) {
+    double *pdBucket = vdBucket[nNet][nKind];
+    if (vdTotal[nNet][nKind] >= MAX_NET_SAMPLES) {
+      vdTotal[nNet][nKind] = 0;
+      for (int i = 0; i < BUCKETS; i++) {
+        pdBucket[i] /= 2;
+        vdTotal[nNet][nKind] += pdBucket[i];
+      }
+    }
+    pdBucket[GetBucket(nMillis)] += 1;
+    vdTotal[nNet][nKind] += 1;
+
+    if (mapGroup.size() >= MAX_GROUPS && !mapGroup.count(vchGroup))
+      mapGroup.clear();
+    CGroupLatency &group = mapGroup[vchGroup];
+    float dSample = nMillis;
+    if (group.nCount[nKind]++ == 0) {
+      group.dMean[nKind] = dSample;
+      group.dDev[nKind] = dSample / 2;
+    } else {
+      group.dDev[nKind] = group.dDev[nKind] * 0.75 + fabs(group.dMean[nKind] - dSample) * 0.25;
+      group.dMean[nKind] = group.dMean[nKind] * 0.875 + dSample * 0.125;
+    }
+  }
+}
+
+int64 CLatencyStats::GetTimeout(const CNetAddr &addr, int nKind, int64 nMaxMillis) {
+  if (!fEnabled) return nMaxMillis;
+  int nNet = addr.GetNetwork();
+  vector<unsigned char> vchGroup = addr.GetGroup();
+  double dEstimate = -1;
+  CRITICAL_BLOCK(cs) {
+    // an occasional full-length wait keeps samples coming from the tail,
+    // which would otherwise be cut off by the timeouts derived from it
+    if (++nRequests % EXPLORE_EVERY == 0)
+      return nMaxMillis;
+    map<vector<unsigned char>, CGroupLatency>::iterator it = mapGroup.find(vchGroup);
+    if (it != mapGroup.end() && it->second.nCount[nKind] >= MIN_GROUP_SAMPLES)
+      dEstimate = it->second.dMean[nKind] + 4 * it->second.dDev[nKind];
+    else if (vdTotal[nNet][nKind] >= MIN_NET_SAMPLES)
+      dEstimate = GetPercentile(nNet, nKind, 0.99);
+  }
+  if (dEstimate < 0)
+    return nMaxMillis;
+  return std::min(std::max((int64)(dEstimate * SAFETY_FACTOR), (int64)MIN_TIMEOUT), nMaxMillis);
+}
@@ -0,0 +1,58 @@
+#ifndef _LATENCY_H_
+#define _LATENCY_H_ 1
+
+#include <map>
+#include <vector>
+
+#include "netbase.h"
+#include "util.h"
+
+enum LatencyKind {
+  LATENCY_CONNECT = 0, // until the connection, and any SOCKS negotiation, is up
+  LATENCY_REPLY = 1,   // from sending our version or a ping to the answer
+  LATENCY_KINDS = 2,
+};
+
+// Connect and reply times seen per network and per netgroup, to set probe
+// timeouts from. A dead address otherwise holds its probe for the whole
+// static timeout, while nearly all live ones answer in a fraction of it.
+class CLatencyStats {
+private:
+  // 4 buckets per doubling, starting at 1ms
+  static const int BUCKETS = 80;
+
+  // smoothed mean and deviation, as TCP keeps for its retransmit timeout;
+  // a full histogram per netgroup would cost too much memory
+  struct CGroupLatency {
+    float dMean[LATENCY_KINDS];
+    float dDev[LATENCY_KINDS];
+    int nCount[LATENCY_KINDS];
+    CGroupLatency();
+  };
+
+  CCriticalSection cs;
+  bool fEnabled;
+  unsigned int nRequests;
+  double vdBucket[NET_MAX][LATENCY_KINDS][BUCKETS]; // decaying sample counts
+  double vdTotal[NET_MAX][LATENCY_KINDS];
+  std::map<std::vector<unsigned char>, CGroupLatency> mapGroup;
+
+  static int GetBucket(int64 nMillis);
+  double GetPercentile(int nNet, int nKind, double dFraction);
+
+public:
+  CLatencyStats();
+
+  // with fEnabledIn false, GetTimeout always returns the static timeout
+  void SetEnabled(bool fEnabledIn) { fEnabled = fEnabledIn; }
+
+  void Record(const CNetAddr &addr, int nKind, int64 nMillis);
+
+  // timeout in milliseconds for the next nKind wait on addr; nMaxMillis,
+  // the static timeout, is both the cap and the answer until there is data
+  int64 GetTimeout(const CNetAddr &addr, int nKind, int64 nMaxMillis);
+};
+
+extern CLatencyStats latency;
+
+#endif
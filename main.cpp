@@ -8,9 +8,14 @@
 #include <stdlib.h>
 #include <getopt.h>
 #include <atomic>
+#include <sys/resource.h>
 
 #include "bitcoin.h"
 #include "db.h"
+#include "uring.h"
+#include "control.h"
+#include "latency.h"
+#include "sha256.h"
 
 using namespace std;
 
@@ -19,6 +24,17 @@ bool fTestNet = false;
 class CDnsSeedOpts {
 public:
   int nThreads;
+  int nLoops;
+  int nProbes;
+  int nScan;
+  int fUseUring;
+  int fAdaptive;
+  int fPipeline;
+  int nKeepAlive;
+  int fFixedTimeouts;
+  int nGroupRate;
+  int nGroupActive;
+  int vnNetProbes[NET_MAX]; // crawlers, or probes per crawler loop, for each network
   int nPort;
   int nP2Port;
   int nMinimumHeight;
@@ -37,7 +53,10 @@ public:
   std::vector<string> vSeeds;
   std::set<uint64_t> filter_whitelist;
 
-  CDnsSeedOpts() : nThreads(96), nDnsThreads(4), ip_addr("::"), nPort(53), nP2Port(0), nMinimumHeight(0), mbox(NULL), ns(NULL), host(NULL), tor(NULL), fUseTestNet(false), fWipeBan(false), fWipeIgnore(false), ipv4_proxy(NULL), ipv6_proxy(NULL), magic(NULL) {}
+  CDnsSeedOpts() : nThreads(96), nLoops(0), nProbes(2048), nScan(0), fUseUring(false), fAdaptive(false), fPipeline(false), nKeepAlive(0), fFixedTimeouts(false), nGroupRate(0), nGroupActive(0), nDnsThreads(4), ip_addr("::"), nPort(53), nP2Port(0), nMinimumHeight(0), mbox(NULL), ns(NULL), host(NULL), tor(NULL), fUseTestNet(false), fWipeBan(false), fWipeIgnore(false), ipv4_proxy(NULL), ipv6_proxy(NULL), magic(NULL) {
+    for (int i=0; i<NET_MAX; i++)
+      vnNetProbes[i] = -1;
+  }
 
   void ParseCommandLine(int argc, char **argv) {
     static const char *help = "Bitcoin-seeder\n"
@@ -49,6 +68,24 @@ public:
                               "-n <ns>         Hostname of the nameserver\n"
                               "-m <mbox>       E-Mail address reported in SOA records\n"
                               "-t <threads>    Number of crawlers to run in parallel (default 96)\n"
+                              "-e <loops>      Number of event-driven crawler loops (default 0: use threads)\n"
+                              "--probes <n>    Concurrent probes per crawler loop (default 2048)\n"
+                              "--netprobes <4>,<6>,<o>\n"
+                              "                Crawlers (or probes per crawler loop) for IPv4, IPv6 and onion\n"
+                              "                addresses, each network from its own queue (default: -t or\n"
+                              "                --probes for IPv4, a quarter of that for IPv6, and with -o, onion)\n"
+                              "--scan <n>      Connect to up to n never tried addresses per crawler loop,\n"
+                              "                on top of --probes; only those that accept get a handshake\n"
+                              "--iouring       Use io_uring instead of epoll in crawler loops\n"
+                              "--adaptive      Adapt the number of concurrent probes, up to -t or --probes\n"
+                              "--pipeline      Send version, verack and getaddr at once to known recent peers\n"
+                              "--keepalive <n> Keep up to n connections to good nodes open, and ping them\n"
+                              "--fixedtimeouts Always use the full timeouts, instead of learning them per network\n"
+                              "--slo <g>,<t>   Revisit good nodes every g minutes and other tried nodes every t\n"
+                              "                minutes (default 20,120); new addresses get the remaining capacity\n"
+                              "--grouplimit <r>,<c>\n"
+                              "                Connect to each netgroup (/16, or /32 for IPv6) at most r times\n"
+                              "                per minute, with at most c probes at once (default 0,0: no limit)\n"
                               "-d <threads>    Number of DNS server threads (default 4)\n"
                               "-a <address>    Address to listen on (default ::)\n"
                               "-p <port>       UDP port to listen on (default 53)\n"
@@ -73,6 +110,17 @@ public:
         {"ns",   required_argument, 0, 'n'},
         {"mbox", required_argument, 0, 'm'},
         {"threads", required_argument, 0, 't'},
+        {"loops", required_argument, 0, 'e'},
+        {"probes", required_argument, 0, 'r'},
+        {"scan", required_argument, 0, 'c'},
+        {"netprobes", required_argument, 0, 'j'},
+        {"iouring", no_argument, &fUseUring, 1},
+        {"adaptive", no_argument, &fAdaptive, 1},
+        {"pipeline", no_argument, &fPipeline, 1},
+        {"keepalive", required_argument, 0, 'l'},
+        {"fixedtimeouts", no_argument, &fFixedTimeouts, 1},
+        {"slo", required_argument, 0, 'g'},
+        {"grouplimit", required_argument, 0, 'u'},
         {"dnsthreads", required_argument, 0, 'd'},
         {"address", required_argument, 0, 'a'},
         {"port", required_argument, 0, 'p'},
@@ -90,7 +138,7 @@ public:
         {0, 0, 0, 0}
       };
       int option_index = 0;
-      int c = getopt_long(argc, argv, "s:h:n:m:t:a:p:d:o:i:k:w:b:q:x:", long_options, &option_index);
+      int c = getopt_long(argc, argv, "s:h:n:m:t:e:r:c:j:l:g:u:a:p:d:o:i:k:w:b:q:x:", long_options, &option_index);
       if (c == -1) break;
       switch (c) {
         case 's': {
@@ -119,6 +167,60 @@ public:
           break;
         }
 
+        case 'e': {
+          int n = strtol(optarg, NULL, 10);
+          if (n >= 0 && n < 1000) nLoops = n;
+          break;
+        }
+
+        case 'r': {
+          int n = strtol(optarg, NULL, 10);
+          if (n > 0 && n <= 100000) nProbes = n;
+          break;
+        }
+
+        case 'c': {
+          int n = strtol(optarg, NULL, 10);
+          if (n >= 0 && n <= 1000000) nScan = n;
+          break;
+        }
+
+        case 'j': {
+          int n4 = -1, n6 = -1, nOnion = -1;
+          if (sscanf(optarg, "%i,%i,%i", &n4, &n6, &nOnion) == 3 && n4 >= 0 && n6 >= 0 && nOnion >= 0 &&
+              n4 <= 100000 && n6 <= 100000 && nOnion <= 100000) {
+            vnNetProbes[NET_IPV4] = n4;
+            vnNetProbes[NET_IPV6] = n6;
+            vnNetProbes[NET_TOR] = nOnion;
+          } else {
+            showHelp = true;
+          }
+          break;
+        }
+
+        case 'g': {
+          int nGood = 0, nTracked = 0;
+          if (sscanf(optarg, "%i,%i", &nGood, &nTracked) == 2 && nGood > 0 && nTracked > 0) {
+            nTierTarget[TIER_GOOD] = nGood * 60;
+            nTierTarget[TIER_TRACKED] = nTracked * 60;
+          } else {
+            showHelp = true;
+          }
+          break;
+        }
+
+        case 'u': {
+          if (sscanf(optarg, "%i,%i", &nGroupRate, &nGroupActive) != 2 || nGroupRate < 0 || nGroupActive < 0)
+            showHelp = true;
+          break;
+        }
+
+        case 'l': {
+          int n = strtol(optarg, NULL, 10);
+          if (n >= 0 && n <= 1000000) nKeepAlive = n;
+          break;
+        }
+
         case 'd': {
           int n = strtol(optarg, NULL, 10);
           if (n > 0 && n < 1000) nDnsThreads = n;
@@ -220,6 +322,12 @@ public:
         filter_whitelist.insert(NODE_NETWORK_LIMITED | NODE_WITNESS | NODE_P2P_V2 | NODE_COMPACT_FILTERS); // xc48
         filter_whitelist.insert(NODE_NETWORK_LIMITED | NODE_WITNESS | NODE_BLOOM); // x40c
     }
+    int nBase = nLoops ? nProbes : nThreads;
+    if (vnNetProbes[NET_IPV4] < 0) vnNetProbes[NET_IPV4] = nBase;
+    if (vnNetProbes[NET_IPV6] < 0) vnNetProbes[NET_IPV6] = std::max(nBase / 4, 1);
+    if (vnNetProbes[NET_TOR] < 0) vnNetProbes[NET_TOR] = tor ? std::max(nBase / 4, 1) : 0;
+    for (int i=0; i<NET_MAX; i++)
+      vnNetProbes[i] = std::max(vnNetProbes[i], 0);
     if (host != NULL && ns == NULL) showHelp = true;
     if (showHelp) fprintf(stderr, help, argv[0]);
   }
@@ -228,17 +336,48 @@ public:
 #include "dns.h"
 
 CAddrDb db;
+// each crawl network has its own probe budget and timeout statistics, so
+// that slow Tor probes through a proxy cannot cut clearnet throughput
+CCrawlControl vControl[NET_MAX];
+
+static const char *pszNetName[NET_MAX] = {"unroutable", "ipv4", "ipv6", "onion", "i2p"};
+
+// crawler threads work the queue of a single network
+struct CCrawlPool {
+  CDnsSeedOpts *opts;
+  int nNet;
+};
+
+// whether to pipeline the handshake with a peer, given what we knew of it
+static bool PipelineHandshake(const CDnsSeedOpts *opts, const CServiceResult &res) {
+  return opts->fPipeline && res.nPrevClientV >= REQUIRE_VERSION;
+}
+
+// the engine ran out of file descriptors after taking nAdded of ips: the rest
+// go back to the db untried, and their slots back to control
+static void ReturnUntried(std::vector<CServiceResult> &ips, int nAdded, CCrawlControl &control) {
+  std::vector<CServiceResult> vUntried(ips.begin() + nAdded, ips.end());
+  for (int i=0; i<vUntried.size(); i++) {
+    vUntried[i].fGood = false;
+    vUntried[i].nOutcome = OUTCOME_LOCAL;
+  }
+  control.Release(vUntried.size());
+  db.ResultMany(vUntried);
+}
 
 extern "C" void* ThreadCrawler(void* data) {
-  int *nThreads=(int*)data;
+  CCrawlPool *pool = (CCrawlPool*)data;
+  CDnsSeedOpts *opts = pool->opts;
   do {
     std::vector<CServiceResult> ips;
     int wait = 5;
-    db.GetMany(ips, 16, wait);
+    db.GetMany(ips, 16, wait, pool->nNet);
     int64 now = time(NULL);
     if (ips.empty()) {
+      // wait is when the next one is due; jitter only keeps the crawlers
+      // from waking all at once
       wait *= 1000;
-      wait += rand() % (500 * *nThreads);
+      wait += rand() % 1000;
       Sleep(wait);
       continue;
     }
@@ -251,7 +390,12 @@ extern "C" void* ThreadCrawler(void* data) {
       res.strClientV = "";
       res.services = 0;
       bool getaddr = res.ourLastSuccess + 86400 < now;
-      res.fGood = TestNode(res.service,res.nBanTime,res.nClientV,res.strClientV,res.nHeight,getaddr ? &addr : NULL, res.services);
+      CCrawlControl &control = vControl[pool->nNet];
+      while (!control.Acquire())
+        Sleep(100);
+      res.fGood = TestNode(res.service,res.nBanTime,res.nClientV,res.strClientV,res.nHeight,getaddr ? &addr : NULL, res.services, res.nError, res.nOutcome, PipelineHandshake(opts, res), res.fPrevGood);
+      control.Report(res.nError);
+      control.Release();
     }
     db.ResultMany(ips);
     db.Add(addr);
@@ -259,6 +403,78 @@ extern "C" void* ThreadCrawler(void* data) {
   return nullptr;
 }
 
+extern "C" void* ThreadCrawlLoop(void* data) {
+  CDnsSeedOpts *opts = (CDnsSeedOpts*)data;
+  CProbeEngine engine(opts->fUseUring);
+  do {
+    int wait = 60;
+    int64 now = time(NULL);
+    bool fFull = false; // out of file descriptors, add nothing more this round
+    // each network is topped up to its own share, from its own queue
+    for (int net = 0; net < NET_MAX && !fFull; net++) {
+      int nProbes = opts->vnNetProbes[net];
+      CCrawlControl &control = vControl[net];
+      while (!fFull && engine.GetCount(net) < nProbes) {
+        int nWant = control.Acquire(std::min(nProbes - engine.GetCount(net), 256));
+        if (!nWant) break;
+        std::vector<CServiceResult> ips;
+        int nWait = 60;
+        db.GetMany(ips, nWant, nWait, net);
+        wait = std::min(wait, nWait);
+        control.Release(nWant - ips.size());
+        int nAdded = 0;
+        while (!fFull && nAdded < ips.size()) {
+          bool getaddr = ips[nAdded].ourLastSuccess + 86400 < now;
+          fFull = !engine.Add(ips[nAdded], getaddr, PipelineHandshake(opts, ips[nAdded]));
+          nAdded++;
+        }
+        if (fFull)
+          ReturnUntried(ips, nAdded, control);
+        if (ips.empty()) break;
+      }
+    }
+    // connect-only stage for never tried addresses, of which most are dead;
+    // only for direct connections, where a refused or silent connect says
+    // something about the address
+    static const int vnScanNet[] = {NET_IPV4, NET_IPV6};
+    for (int n = 0; n < 2 && !fFull; n++) {
+      int net = vnScanNet[n];
+      CCrawlControl &control = vControl[net];
+      while (!fFull && opts->vnNetProbes[net] && engine.GetScanCount() < opts->nScan) {
+        int nWant = control.Acquire(std::min(opts->nScan - engine.GetScanCount(), 256));
+        if (!nWant) break;
+        std::vector<CServiceResult> ips;
+        db.GetUnknown(ips, nWant, net);
+        control.Release(nWant - ips.size());
+        int nAdded = 0;
+        while (!fFull && nAdded < ips.size())
+          fFull = !engine.Add(ips[nAdded++], true, false, true);
+        if (fFull)
+          ReturnUntried(ips, nAdded, control);
+        if (ips.empty()) break;
+      }
+    }
+    std::vector<CServiceResult> done;
+    vector<CAddress> addr;
+    engine.Poll(engine.GetCount() ? 1000 : wait * 1000, done, addr);
+    for (int i=0; i<done.size(); i++) {
+      CCrawlControl &control = vControl[GetCrawlNet(done[i].service)];
+      control.Report(done[i].nError);
+      control.Release();
+    }
+    if (!done.empty())
+      db.ResultMany(done);
+    if (!addr.empty())
+      db.Add(addr);
+  } while(1);
+  return nullptr;
+}
+
+extern "C" void* ThreadKeepAlive(void*) {
+  keepalive.Run();
+  return nullptr;
+}
+
 extern "C" int GetIPList(void *thread, char *requestedHostname, addr_t *addr, int max, int ipv4, int ipv6);
 
 class CDnsThread {
@@ -438,6 +654,7 @@ extern "C" void* ThreadDumper(void*) {
 
 extern "C" void* ThreadStats(void*) {
   bool first = true;
+  int64 nPrevVisits[TIER_UNKNOWN] = {}, nPrevLate[TIER_UNKNOWN] = {};
   do {
     char c[256];
     time_t tim = time(NULL);
@@ -460,6 +677,24 @@ extern "C" void* ThreadStats(void*) {
       queries += dnsThread[i]->dbQueries;
     }
     printf("%s %i/%i available (%i tried in %is, %i new, %i active), %i banned; %llu DNS requests, %llu db queries", c, stats.nGood, stats.nAvail, stats.nTracked, stats.nAge, stats.nNew, stats.nAvail - stats.nTracked - stats.nNew, stats.nBanned, (unsigned long long)requests, (unsigned long long)queries);
+    if (keepalive.IsEnabled())
+      printf("; %i kept", keepalive.GetCount());
+    for (int net = 0; net < NET_MAX; net++) {
+      vControl[net].Adjust();
+      if (stats.nNetAvail[net])
+        printf("; %s %i/%i, %i active", pszNetName[net], stats.nNetGood[net], stats.nNetAvail[net], stats.nNetActive[net]);
+      if (vControl[net].IsAdaptive())
+        printf("; %s %s", pszNetName[net], vControl[net].GetStatus().c_str());
+    }
+    static const char *pszTier[TIER_UNKNOWN] = {"good", "tracked"};
+    printf("; late");
+    for (int tier = 0; tier < TIER_UNKNOWN; tier++) {
+      int64 nVisits = stats.nVisits[tier] - nPrevVisits[tier];
+      int64 nLate = stats.nLateVisits[tier] - nPrevLate[tier];
+      nPrevVisits[tier] = stats.nVisits[tier];
+      nPrevLate[tier] = stats.nLateVisits[tier];
+      printf(" %s %i%%%s", pszTier[tier], nVisits ? (int)(nLate * 100 / nVisits) : 0, stats.fOverdue[tier] ? " (SLO missed)" : "");
+    }
     Sleep(1000);
   } while(1);
   return nullptr;
@@ -557,6 +792,7 @@ int main(int argc, char **argv) {
     printf("Using minimum height %i\n", opts.nMinimumHeight);
     nMinimumHeight = opts.nMinimumHeight;
   }
+  printf("Using %s sha256d\n", SHA256DImplementation());
   if (!opts.vSeeds.empty()) {
     printf("Overriding DNS seeds\n");
     swap(opts.vSeeds, vSeeds);
@@ -577,13 +813,19 @@ int main(int argc, char **argv) {
     fprintf(stderr, "No e-mail address set. Please use -m.\n");
     exit(1);
   }
+  // addresses of a network without crawlers would pile up untried
+  bool vfCrawled[NET_MAX];
+  for (int net = 0; net < NET_MAX; net++)
+    vfCrawled[net] = opts.vnNetProbes[net] > 0;
+  db.SetCrawledNets(vfCrawled);
+  db.SetFilters(opts.filter_whitelist);
   FILE *f = fopen("dnsseed.dat","r");
   if (f) {
     printf("Loading dnsseed.dat...");
     CAutoFile cf(f);
     cf >> db;
     if (opts.fWipeBan)
-        db.banned.clear();
+        db.ClearBanned();
     if (opts.fWipeIgnore)
         db.ResetIgnores();
     printf("done\n");
@@ -603,16 +845,73 @@ int main(int argc, char **argv) {
   printf("Starting seeder...");
   pthread_create(&threadSeed, NULL, ThreadSeeder, NULL);
   printf("done\n");
-  printf("Starting %i crawler threads...", opts.nThreads);
-  pthread_attr_t attr_crawler;
-  pthread_attr_init(&attr_crawler);
-  pthread_attr_setstacksize(&attr_crawler, 0x20000);
-  for (int i=0; i<opts.nThreads; i++) {
-    pthread_t thread;
-    pthread_create(&thread, &attr_crawler, ThreadCrawler, &opts.nThreads);
+  int nCpus = std::max((int)sysconf(_SC_NPROCESSORS_ONLN), 1);
+  string strPools;
+  for (int net = 0; net < NET_MAX; net++) {
+    if (opts.vnNetProbes[net])
+      strPools += strprintf("%s%i %s", strPools.empty() ? "" : ", ", opts.vnNetProbes[net], pszNetName[net]);
+  }
+  for (int net = 0; net < NET_MAX; net++) {
+    if (!opts.vnNetProbes[net]) continue;
+    // the scan stage draws on the budget of the network it scans
+    bool fScan = net == NET_IPV4 || net == NET_IPV6;
+    int nMax = opts.nLoops ? opts.nLoops * (opts.vnNetProbes[net] + (fScan ? opts.nScan : 0)) : opts.vnNetProbes[net];
+    if (opts.fAdaptive)
+      vControl[net].Init(nMax / 4, nMax / 64, nMax, opts.nLoops ? std::min(opts.nLoops, nCpus) : nCpus);
+    else
+      vControl[net].Init(nMax, nMax, nMax, nCpus);
+  }
+  latency.SetEnabled(!opts.fFixedTimeouts);
+  db.SetGroupLimits(opts.nGroupRate, opts.nGroupActive);
+  if (opts.nLoops || opts.nKeepAlive) {
+    struct rlimit rlim;
+    if (getrlimit(RLIMIT_NOFILE, &rlim) == 0 && rlim.rlim_cur < rlim.rlim_max) {
+      rlim.rlim_cur = rlim.rlim_max;
+      setrlimit(RLIMIT_NOFILE, &rlim);
+    }
+  }
+  if (opts.nLoops && opts.fUseUring) {
+    CIoUring uring;
+    if (!uring.Init(8)) {
+      printf("io_uring unavailable, using epoll\n");
+      opts.fUseUring = false;
+    }
+  }
+  if (opts.nKeepAlive) {
+    if (opts.nLoops && opts.fUseUring) {
+      printf("Keep-alive pool not supported with io_uring\n");
+    } else {
+      printf("Starting keep-alive pool (up to %i connections)...", opts.nKeepAlive);
+      keepalive.Init(opts.nKeepAlive);
+      pthread_t threadKeepAlive;
+      pthread_create(&threadKeepAlive, NULL, ThreadKeepAlive, NULL);
+      printf("done\n");
+    }
+  }
+  if (opts.nLoops) {
+    printf("Starting %i crawler loops (%s probes each, %s)...", opts.nLoops, strPools.c_str(), opts.fUseUring ? "io_uring" : "epoll");
+    for (int i=0; i<opts.nLoops; i++) {
+      pthread_t thread;
+      pthread_create(&thread, NULL, ThreadCrawlLoop, &opts);
+    }
+    printf("done\n");
+  } else {
+    printf("Starting crawler threads (%s)...", strPools.c_str());
+    pthread_attr_t attr_crawler;
+    pthread_attr_init(&attr_crawler);
+    pthread_attr_setstacksize(&attr_crawler, 0x20000);
+    static CCrawlPool vPool[NET_MAX];
+    for (int net = 0; net < NET_MAX; net++) {
+      vPool[net].opts = &opts;
+      vPool[net].nNet = net;
+      for (int i=0; i<opts.vnNetProbes[net]; i++) {
+        pthread_t thread;
+        pthread_create(&thread, &attr_crawler, ThreadCrawler, &vPool[net]);
+      }
+    }
+    pthread_attr_destroy(&attr_crawler);
+    printf("done\n");
   }
-  pthread_attr_destroy(&attr_crawler);
-  printf("done\n");
   pthread_create(&threadStats, NULL, ThreadStats, NULL);
   pthread_create(&threadDump, NULL, ThreadDumper, NULL);
   void* res;
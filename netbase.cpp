@@ -8,6 +8,8 @@
 
 #ifndef WIN32
 #include <sys/fcntl.h>
+#include <sys/epoll.h>
+#include <poll.h>
 #endif
 
 #include "strlcpy.h"
@@ -22,6 +24,7 @@ typedef std::pair<CService, int> proxyType;
 static proxyType proxyInfo[NET_MAX];
 static proxyType nameproxyInfo;
 int nConnectTimeout = 5000;
+int nSocksTimeout = 120000; // includes the proxy's own connection to the destination
 bool fNameLookup = false;
 
 static const unsigned char pchIPv4[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
@@ -162,50 +165,6 @@ bool LookupNumeric(const char *pszName, CService& addr, int portDefault)
     return Lookup(pszName, addr, portDefault, false);
 }
 
-bool static Socks4(const CService &addrDest, SOCKET& hSocket)
-{
-    printf("SOCKS4 connecting %s\n", addrDest.ToString().c_str());
-    if (!addrDest.IsIPv4())
-    {
-        closesocket(hSocket);
-        return error("Proxy destination is not IPv4");
-    }
-    char pszSocks4IP[] = "\4\1\0\0\0\0\0\0user";
-    struct sockaddr_in addr;
-    socklen_t len = sizeof(addr);
-    if (!addrDest.GetSockAddr((struct sockaddr*)&addr, &len) || addr.sin_family != AF_INET)
-    {
-        closesocket(hSocket);
-        return error("Cannot get proxy destination address");
-    }
-    memcpy(pszSocks4IP + 2, &addr.sin_port, 2);
-    memcpy(pszSocks4IP + 4, &addr.sin_addr, 4);
-    char* pszSocks4 = pszSocks4IP;
-    int nSize = sizeof(pszSocks4IP);
-
-    int ret = send(hSocket, pszSocks4, nSize, MSG_NOSIGNAL);
-    if (ret != nSize)
-    {
-        closesocket(hSocket);
-        return error("Error sending to proxy");
-    }
-    char pchRet[8];
-    if (recv(hSocket, pchRet, 8, 0) != 8)
-    {
-        closesocket(hSocket);
-        return error("Error reading proxy response");
-    }
-    if (pchRet[1] != 0x5a)
-    {
-        closesocket(hSocket);
-        if (pchRet[1] != 0x5b)
-            printf("ERROR: Proxy returned error %d\n", pchRet[1]);
-        return false;
-    }
-    printf("SOCKS4 connected %s\n", addrDest.ToString().c_str());
-    return true;
-}
-
 bool static Socks5(string strDest, int port, SOCKET& hSocket)
 {
     printf("SOCKS5 connecting %s\n", strDest.c_str());
@@ -345,14 +304,13 @@ bool static ConnectSocketDirectly(const CService &addrConnect, SOCKET& hSocketRe
         // WSAEINVAL is here because some legacy version of winsock uses it
         if (WSAGetLastError() == WSAEINPROGRESS || WSAGetLastError() == WSAEWOULDBLOCK || WSAGetLastError() == WSAEINVAL)
         {
-            struct timeval timeout;
-            timeout.tv_sec  = nTimeout / 1000;
-            timeout.tv_usec = (nTimeout % 1000) * 1000;
-
-            fd_set fdset;
-            FD_ZERO(&fdset);
-            FD_SET(hSocket, &fdset);
-            int nRet = select(hSocket + 1, NULL, &fdset, NULL, &timeout);
+            // poll() rather than select(), as crawler event loops raise the
+            // descriptor limit beyond FD_SETSIZE
+            struct pollfd pfd;
+            pfd.fd = hSocket;
+            pfd.events = POLLOUT;
+            pfd.revents = 0;
+            int nRet = poll(&pfd, 1, nTimeout);
             if (nRet == 0)
             {
                 printf("connection timeout\n");
@@ -361,7 +319,7 @@ bool static ConnectSocketDirectly(const CService &addrConnect, SOCKET& hSocketRe
             }
             if (nRet == SOCKET_ERROR)
             {
-                printf("select() for connection failed: %i\n",WSAGetLastError());
+                printf("poll() for connection failed: %i\n",WSAGetLastError());
                 closesocket(hSocket);
                 return false;
             }
@@ -378,7 +336,7 @@ bool static ConnectSocketDirectly(const CService &addrConnect, SOCKET& hSocketRe
             }
             if (nRet != 0)
             {
-                printf("connect() failed after select(): %s\n",strerror(nRet));
+                printf("connect() failed after poll(): %s\n",strerror(nRet));
                 closesocket(hSocket);
                 return false;
             }
@@ -453,34 +411,308 @@ bool IsProxy(const CNetAddr &addr) {
     return false;
 }
 
-bool ConnectSocket(const CService &addrDest, SOCKET& hSocketRet, int nTimeout)
+CPendingConnect::CPendingConnect() : hSocket(INVALID_SOCKET), nState(PENDING_NONE), nError(0), nSocksVersion(0), nSockAddrLen(0), nDeadline(0), nRecvNeeded(0), nEvents(0)
+{
+}
+
+CPendingConnect::~CPendingConnect()
+{
+    closesocket(hSocket);
+}
+
+void CPendingConnect::Fail(int nErr)
+{
+    closesocket(hSocket);
+    nError = nErr ? nErr : ECONNABORTED;
+    nState = PENDING_FAILED;
+}
+
+bool CPendingConnect::Start(const CService &addrConnect, const CService &addrDestIn, int nSocksVersionIn, int nTimeout, bool fConnect)
+{
+    addrDest = addrDestIn;
+    nSocksVersion = nSocksVersionIn;
+    nDeadline = GetTimeMillis() + nTimeout;
+    nState = PENDING_CONNECT;
+
+    nSockAddrLen = sizeof(sockaddr);
+    if (!addrConnect.GetSockAddr((struct sockaddr*)&sockaddr, &nSockAddrLen)) {
+        Fail(EAFNOSUPPORT);
+        return false;
+    }
+
+    hSocket = socket(((struct sockaddr*)&sockaddr)->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+    if (hSocket == INVALID_SOCKET) {
+        Fail(WSAGetLastError());
+        return false;
+    }
+#ifdef SO_NOSIGPIPE
+    int set = 1;
+    setsockopt(hSocket, SOL_SOCKET, SO_NOSIGPIPE, (void*)&set, sizeof(int));
+#endif
+
+    if (fConnect && connect(hSocket, (struct sockaddr*)&sockaddr, nSockAddrLen) == SOCKET_ERROR && WSAGetLastError() != WSAEINPROGRESS) {
+        Fail(WSAGetLastError());
+        return false;
+    }
+    return true;
+}
+
+bool CPendingConnect::WantsWrite() const
+{
+    return nState == PENDING_CONNECT || !vchSend.empty();
+}
+
+bool CPendingConnect::Flush()
+{
+    if (vchSend.empty())
+        return true;
+    int nBytes = send(hSocket, &vchSend[0], vchSend.size(), MSG_NOSIGNAL);
+    if (nBytes > 0) {
+        vchSend.erase(vchSend.begin(), vchSend.begin() + nBytes);
+        return true;
+    }
+    if (nBytes < 0 && (WSAGetLastError() == WSAEWOULDBLOCK || WSAGetLastError() == WSAEINTR))
+        return true;
+    Fail(EPROXY);
+    return false;
+}
+
+// returns true once nRecvNeeded bytes are available
+bool CPendingConnect::Fill()
+{
+    size_t nPos = vchRecv.size();
+    if (nPos >= nRecvNeeded)
+        return true;
+    vchRecv.resize(nRecvNeeded);
+    int nBytes = recv(hSocket, &vchRecv[nPos], nRecvNeeded - nPos, 0);
+    vchRecv.resize(nPos + std::max(nBytes, 0));
+    if (nBytes < 0 && (WSAGetLastError() == WSAEWOULDBLOCK || WSAGetLastError() == WSAEINTR))
+        return false;
+    if (nBytes <= 0) {
+        Fail(EPROXY);
+        return false;
+    }
+    return vchRecv.size() >= nRecvNeeded;
+}
+
+void CPendingConnect::Connected(int nErr)
+{
+    if (nState != PENDING_CONNECT)
+        return;
+    // with a proxy, this is the connection to the proxy itself
+    if (nErr != 0)
+        return Fail(nSocksVersion ? EPROXY : nErr);
+    if (nSocksVersion == 4) {
+        struct sockaddr_in addr;
+        socklen_t len = sizeof(addr);
+        if (!addrDest.IsIPv4() || !addrDest.GetSockAddr((struct sockaddr*)&addr, &len) || addr.sin_family != AF_INET)
+            return Fail(EAFNOSUPPORT);
+        char pszSocks4IP[] = "\4\1\0\0\0\0\0\0user";
+        memcpy(pszSocks4IP + 2, &addr.sin_port, 2);
+        memcpy(pszSocks4IP + 4, &addr.sin_addr, 4);
+        vchSend.assign(pszSocks4IP, pszSocks4IP + sizeof(pszSocks4IP));
+        nRecvNeeded = 8;
+        nState = PENDING_SOCKS4;
+    } else if (nSocksVersion == 5) {
+        vchSend.assign("\5\1\0", "\5\1\0" + 3);
+        nRecvNeeded = 2;
+        nState = PENDING_SOCKS5_INIT;
+    } else {
+        nState = PENDING_DONE;
+        return;
+    }
+    nDeadline = GetTimeMillis() + nSocksTimeout;
+    Process();
+}
+
+void CPendingConnect::Process()
+{
+    if (nState == PENDING_CONNECT) {
+        int nRet = 0;
+        socklen_t nRetSize = sizeof(nRet);
+        if (getsockopt(hSocket, SOL_SOCKET, SO_ERROR, &nRet, &nRetSize) == SOCKET_ERROR)
+            return Fail(WSAGetLastError());
+        return Connected(nRet);
+    }
+    while (nState == PENDING_SOCKS4 || nState == PENDING_SOCKS5_INIT || nState == PENDING_SOCKS5_CONNECT) {
+        if (!Flush() || !vchSend.empty() || !Fill())
+            return;
+        if (nState == PENDING_SOCKS4) {
+            // SOCKS4 does not say whether the proxy or the destination refused
+            if (vchRecv[1] != 0x5a)
+                return Fail(EPROXY);
+            nState = PENDING_DONE;
+        } else if (nState == PENDING_SOCKS5_INIT) {
+            if (vchRecv[0] != 0x05 || vchRecv[1] != 0x00)
+                return Fail(EPROXY);
+            std::string strDest = addrDest.ToStringIP();
+            if (strDest.size() > 255)
+                return Fail(EPROXY);
+            int port = addrDest.GetPort();
+            vchSend.clear();
+            vchSend.push_back(0x05);
+            vchSend.push_back(0x01);
+            vchSend.push_back(0x00);
+            vchSend.push_back(0x03);
+            vchSend.push_back(strDest.size());
+            vchSend.insert(vchSend.end(), strDest.begin(), strDest.end());
+            vchSend.push_back((port >> 8) & 0xFF);
+            vchSend.push_back((port >> 0) & 0xFF);
+            vchRecv.clear();
+            nRecvNeeded = 5; // reply header, plus the first byte of the bound address
+            nState = PENDING_SOCKS5_CONNECT;
+        } else {
+            if (vchRecv[0] != 0x05 || vchRecv[2] != 0x00)
+                return Fail(EPROXY);
+            // only these replies are about the destination
+            switch (vchRecv[1])
+            {
+                case 0x00: break;
+                case 0x04: return Fail(EHOSTUNREACH);
+                case 0x05: return Fail(ECONNREFUSED);
+                case 0x06: return Fail(ETIMEDOUT);
+                default:   return Fail(EPROXY);
+            }
+            size_t nTotal;
+            switch (vchRecv[3])
+            {
+                case 0x01: nTotal = 4 + 4 + 2; break;
+                case 0x04: nTotal = 4 + 16 + 2; break;
+                case 0x03: nTotal = 4 + 1 + (unsigned char)vchRecv[4] + 2; break;
+                default:   return Fail(EPROXY);
+            }
+            if (nRecvNeeded < nTotal)
+                nRecvNeeded = nTotal;
+            else
+                nState = PENDING_DONE;
+        }
+    }
+}
+
+void CPendingConnect::Expire()
+{
+    // a proxy that does not even take the request is at fault, not the destination
+    if (nState == PENDING_SOCKS5_INIT || (nState == PENDING_CONNECT && nSocksVersion))
+        Fail(EPROXY);
+    else if (!IsFinished())
+        Fail(ETIMEDOUT);
+}
+
+SOCKET CPendingConnect::Release()
+{
+    SOCKET hRet = hSocket;
+    hSocket = INVALID_SOCKET;
+    return hRet;
+}
+
+bool ConnectSocketAsync(const CService &addrDest, CPendingConnect &conn, int nTimeout, bool fConnect)
 {
     const proxyType &proxy = proxyInfo[addrDest.GetNetwork()];
 
-    // no proxy needed
     if (!proxy.second)
-        return ConnectSocketDirectly(addrDest, hSocketRet, nTimeout);
+        return conn.Start(addrDest, addrDest, 0, nTimeout, fConnect);
+    return conn.Start(proxy.first, addrDest, proxy.second, nTimeout, fConnect);
+}
 
-    SOCKET hSocket = INVALID_SOCKET;
+CConnectMux::CConnectMux()
+{
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+}
 
-    // first connect to proxy server
-    if (!ConnectSocketDirectly(proxy.first, hSocket, nTimeout))
-        return false;
+CConnectMux::~CConnectMux()
+{
+    close(epfd);
+}
 
-    // do socks negotiation
-    switch (proxy.second) {
-    case 4:
-        if (!Socks4(addrDest, hSocket))
-            return false;
-        break;
-    case 5:
-        if (!Socks5(addrDest.ToStringIP(), addrDest.GetPort(), hSocket))
-            return false;
-        break;
-    default:
+void CConnectMux::Watch(CPendingConnect *conn)
+{
+    unsigned int nEvents = conn->WantsWrite() ? EPOLLOUT : EPOLLIN;
+    if (conn->nEvents == nEvents)
+        return;
+    struct epoll_event ev = {};
+    ev.events = nEvents;
+    ev.data.ptr = conn;
+    epoll_ctl(epfd, conn->nEvents ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, conn->hSocket, &ev);
+    conn->nEvents = nEvents;
+}
+
+void CConnectMux::Remove(CPendingConnect *conn, std::vector<CPendingConnect*> &vDone)
+{
+    if (conn->nEvents && conn->hSocket != INVALID_SOCKET)
+        epoll_ctl(epfd, EPOLL_CTL_DEL, conn->hSocket, NULL);
+    conn->nEvents = 0;
+    mapDeadline.erase(conn->itDeadline);
+    vDone.push_back(conn);
+}
+
+void CConnectMux::Add(CPendingConnect *conn)
+{
+    conn->nEvents = 0;
+    conn->itDeadline = mapDeadline.insert(std::make_pair(conn->nDeadline, conn));
+    Watch(conn);
+}
+
+void CConnectMux::Wait(int nMilliSec, std::vector<CPendingConnect*> &vDone)
+{
+    struct epoll_event events[256];
+    int64 nNow = GetTimeMillis();
+    if (!mapDeadline.empty() && GetNextDeadline() - nNow < nMilliSec)
+        nMilliSec = std::max(GetNextDeadline() - nNow, (int64)0);
+    int n = epoll_wait(epfd, events, ARRAYLEN(events), nMilliSec);
+    for (int i=0; i<n; i++) {
+        CPendingConnect *conn = (CPendingConnect*)events[i].data.ptr;
+        conn->Process();
+        if (conn->IsFinished()) {
+            Remove(conn, vDone);
+            continue;
+        }
+        if (conn->nDeadline != conn->itDeadline->first) {
+            mapDeadline.erase(conn->itDeadline);
+            conn->itDeadline = mapDeadline.insert(std::make_pair(conn->nDeadline, conn));
+        }
+        Watch(conn);
+    }
+    nNow = GetTimeMillis();
+    while (!mapDeadline.empty() && mapDeadline.begin()->first <= nNow) {
+        CPendingConnect *conn = mapDeadline.begin()->second;
+        conn->Expire();
+        Remove(conn, vDone);
+    }
+}
+
+bool ConnectSocket(const CService &addrDest, SOCKET& hSocketRet, int nTimeout)
+{
+    CPendingConnect conn;
+    if (!ConnectSocketAsync(addrDest, conn, nTimeout)) {
+        errno = conn.GetError();
+        return false;
+    }
+    while (!conn.IsFinished()) {
+        int64 nWait = conn.GetDeadline() - GetTimeMillis();
+        if (nWait <= 0) {
+            conn.Expire();
+            break;
+        }
+        struct pollfd pfd;
+        pfd.fd = conn.GetSocket();
+        pfd.events = conn.WantsWrite() ? POLLOUT : POLLIN;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, nWait) > 0)
+            conn.Process();
+    }
+    if (!conn.IsDone()) {
+        errno = conn.GetError();
         return false;
     }
 
+    // callers of the synchronous interface expect a blocking socket
+    SOCKET hSocket = conn.Release();
+    int fFlags = fcntl(hSocket, F_GETFL, 0);
+    if (fcntl(hSocket, F_SETFL, fFlags & ~O_NONBLOCK) == SOCKET_ERROR)
+    {
+        closesocket(hSocket);
+        return false;
+    }
     hSocketRet = hSocket;
     return true;
 }
@@ -1110,6 +1342,13 @@ std::vector<unsigned char> CService::GetKey() const
      return vKey;
 }
 
+void CService::GetKey(unsigned char *pchKey) const
+{
+     memcpy(pchKey, ip, 16);
+     pchKey[16] = port / 0x100;
+     pchKey[17] = port & 0x0FF;
+}
+
 std::string CService::ToStringPort() const
 {
     return strprintf("%u", port);
@@ -4,6 +4,7 @@
 #ifndef BITCOIN_NETBASE_H
 #define BITCOIN_NETBASE_H
 
+#include <map>
 #include <string>
 #include <vector>
 
@@ -29,8 +30,12 @@ enum Network
 };
 
 extern int nConnectTimeout;
+extern int nSocksTimeout;
 extern bool fNameLookup;
 
+/** errno-style reason for a connection that failed at the SOCKS proxy rather than at the destination */
+static const int EPROXY = 0x10000;
+
 /** IP address (IPv6, or IPv4 using mapped IPv6 range (::FFFF:0:0/96)) */
 class CNetAddr
 {
@@ -111,6 +116,7 @@ class CService : public CNetAddr
         friend bool operator!=(const CService& a, const CService& b);
         friend bool operator<(const CService& a, const CService& b);
         std::vector<unsigned char> GetKey() const;
+        void GetKey(unsigned char *pchKey) const; // the same 18 bytes, without allocating
         std::string ToString() const;
         std::string ToStringPort() const;
         std::string ToStringIPPort() const;
@@ -145,4 +151,85 @@ bool LookupNumeric(const char *pszName, CService& addr, int portDefault = 0);
 bool ConnectSocket(const CService &addr, SOCKET& hSocketRet, int nTimeout = nConnectTimeout);
 bool ConnectSocketByName(CService &addr, SOCKET& hSocketRet, const char *pszDest, int portDefault = 0, int nTimeout = nConnectTimeout);
 
+/** A connection attempt in progress on a non-blocking socket, including SOCKS negotiation */
+class CPendingConnect
+{
+    protected:
+        enum State
+        {
+            PENDING_NONE,
+            PENDING_CONNECT,
+            PENDING_SOCKS4,
+            PENDING_SOCKS5_INIT,
+            PENDING_SOCKS5_CONNECT,
+            PENDING_DONE,
+            PENDING_FAILED,
+        };
+
+        SOCKET hSocket;
+        int nState;
+        int nError;          // errno-style reason for failure
+        int nSocksVersion;
+        CService addrDest;
+        struct sockaddr_storage sockaddr; // address connected to (destination or proxy)
+        socklen_t nSockAddrLen;
+        int64 nDeadline;     // in milliseconds
+        std::vector<char> vchSend;
+        std::vector<char> vchRecv;
+        size_t nRecvNeeded;
+        unsigned int nEvents; // events registered with a CConnectMux
+        std::multimap<int64, CPendingConnect*>::iterator itDeadline;
+
+        void Fail(int nErr);
+        bool Flush();
+        bool Fill();
+
+        friend class CConnectMux;
+
+    public:
+        CPendingConnect();
+        ~CPendingConnect();
+        // with fConnect=false, only the socket is created; the caller issues
+        // connect() to GetSockAddr() itself, and reports back through Connected()
+        bool Start(const CService &addrConnect, const CService &addrDestIn, int nSocksVersionIn, int nTimeout, bool fConnect = true);
+        void Connected(int nErr);
+        void Process();      // advance after the socket became ready
+        void Expire();       // give up, the deadline passed
+        SOCKET Release();    // take ownership of the connected socket
+        bool IsDone() const { return nState == PENDING_DONE; }
+        bool IsFailed() const { return nState == PENDING_FAILED; }
+        bool IsFinished() const { return IsDone() || IsFailed(); }
+        bool IsConnecting() const { return nState == PENDING_CONNECT; }
+        bool WantsWrite() const;
+        int GetError() const { return nError; }
+        int64 GetDeadline() const { return nDeadline; }
+        SOCKET GetSocket() const { return hSocket; }
+        const struct sockaddr *GetSockAddr(socklen_t &len) const { len = nSockAddrLen; return (const struct sockaddr*)&sockaddr; }
+        const CService &GetDest() const { return addrDest; }
+};
+
+/** Completes many pending connections at once, each with its own deadline */
+class CConnectMux
+{
+    private:
+        int epfd;
+        std::multimap<int64, CPendingConnect*> mapDeadline;
+
+        void Watch(CPendingConnect *conn);
+        void Remove(CPendingConnect *conn, std::vector<CPendingConnect*> &vDone);
+
+    public:
+        CConnectMux();
+        ~CConnectMux();
+        int GetFD() const { return epfd; }  // readable when Wait() has work; can be nested in another epoll set
+        int size() const { return mapDeadline.size(); }
+        int64 GetNextDeadline() const { return mapDeadline.empty() ? 0 : mapDeadline.begin()->first; }
+        void Add(CPendingConnect *conn);   // conn must have been started successfully
+        // Process ready connections and expire late ones. Finished connections
+        // (successful or not) stop being watched, and are appended to vDone.
+        void Wait(int nMilliSec, std::vector<CPendingConnect*> &vDone);
+};
+
+bool ConnectSocketAsync(const CService &addrDest, CPendingConnect &conn, int nTimeout = nConnectTimeout, bool fConnect = true);
+
 #endif
@@ -56,7 +56,7 @@ typedef unsigned long long  uint64;
 #endif
 
 class CScript;
-class CDataStream;
+template<typename Alloc> class CBaseDataStream;
 class CAutoFile;
 static const unsigned int MAX_SIZE = 0x02000000;
 
@@ -555,6 +555,23 @@ inline void Unserialize(Stream& is, std::vector<T, A>& v, int nType, int nVersio
     Unserialize_impl(is, v, nType, nVersion, boost::is_fundamental<T>());
 }
 
+// Read a serialized vector<T> one element at a time, passing each to fn
+// instead of building the vector. Stops early when fn returns false.
+// Returns the element count the stream announced.
+template<typename T, typename Stream, typename Fn>
+uint64 UnserializeEach(Stream& is, Fn fn)
+{
+    uint64 nSize = ReadCompactSize(is);
+    for (uint64 i = 0; i < nSize; i++)
+    {
+        T obj;
+        Unserialize(is, obj, is.GetType(), is.GetVersion());
+        if (!fn(obj))
+            break;
+    }
+    return nSize;
+}
+
 
 
 //
@@ -827,16 +844,116 @@ struct secure_allocator : public std::allocator<T>
 };
 
 
+//
+// Per-thread free lists of buffers, by power-of-two size class. Used for
+// public network data, which needs neither mlock nor clearing on free.
+//
+class CBufferPool
+{
+    enum
+    {
+        MIN_CLASS = 6,  // 64 bytes
+        MAX_CLASS = 20, // 1 MiB; larger buffers bypass the pool
+        MAX_FREE = 64,  // buffers kept per size class
+    };
+    std::vector<void*> vFree[MAX_CLASS - MIN_CLASS + 1];
+
+    static int GetClass(size_t nSize)
+    {
+        int nClass = MIN_CLASS;
+        while (nClass <= MAX_CLASS && ((size_t)1 << nClass) < nSize)
+            nClass++;
+        return nClass;
+    }
+
+public:
+    ~CBufferPool()
+    {
+        for (int i = 0; i <= MAX_CLASS - MIN_CLASS; i++)
+            for (unsigned int j = 0; j < vFree[i].size(); j++)
+                ::operator delete(vFree[i][j]);
+    }
+
+    void* Allocate(size_t nSize)
+    {
+        int nClass = GetClass(nSize);
+        if (nClass > MAX_CLASS)
+            return ::operator new(nSize);
+        std::vector<void*>& vList = vFree[nClass - MIN_CLASS];
+        if (vList.empty())
+            return ::operator new((size_t)1 << nClass);
+        void* p = vList.back();
+        vList.pop_back();
+        return p;
+    }
+
+    void Free(void* p, size_t nSize)
+    {
+        int nClass = GetClass(nSize);
+        if (nClass > MAX_CLASS || vFree[nClass - MIN_CLASS].size() >= MAX_FREE)
+            ::operator delete(p);
+        else
+            vFree[nClass - MIN_CLASS].push_back(p);
+    }
+
+    // The calling thread's pool. Buffers may be freed on another thread than
+    // the one that allocated them; they then move to that thread's pool.
+    static CBufferPool& Get()
+    {
+        static thread_local CBufferPool pool;
+        return pool;
+    }
+};
+
+//
+// Allocator that draws from the calling thread's CBufferPool. Memory is
+// never locked, so unlike secure_allocator it costs no syscalls.
+//
+template<typename T>
+struct pool_allocator : public std::allocator<T>
+{
+    typedef std::allocator<T> base;
+    typedef typename base::size_type size_type;
+    typedef typename base::difference_type  difference_type;
+    typedef typename base::pointer pointer;
+    typedef typename base::const_pointer const_pointer;
+    typedef typename base::reference reference;
+    typedef typename base::const_reference const_reference;
+    typedef typename base::value_type value_type;
+    pool_allocator() throw() {}
+    pool_allocator(const pool_allocator& a) throw() : base(a) {}
+    template <typename U>
+    pool_allocator(const pool_allocator<U>& a) throw() : base(a) {}
+    ~pool_allocator() throw() {}
+    template<typename _Other> struct rebind
+    { typedef pool_allocator<_Other> other; };
+
+    T* allocate(std::size_t n, const void *hint = 0)
+    {
+        return (T*)CBufferPool::Get().Allocate(sizeof(T) * n);
+    }
+
+    void deallocate(T* p, std::size_t n)
+    {
+        if (p != NULL)
+            CBufferPool::Get().Free(p, sizeof(T) * n);
+    }
+};
+
+
 
 //
 // Double ended buffer combining vector and stream-like interfaces.
 // >> and << read and write unformatted data using the above serialization templates.
 // Fills with data in linear time; some stringstream implementations take N^2 time.
+// CDataStream keeps its contents in locked memory; CNetDataStream is for
+// network traffic, and uses pooled memory instead.
 //
-class CDataStream
+template<typename Alloc>
+class CBaseDataStream
 {
 protected:
-    typedef std::vector<char, secure_allocator<char> > vector_type;
+    typedef std::vector<char, Alloc> vector_type;
     vector_type vch;
     unsigned int nReadPos;
     short state;
@@ -845,44 +962,44 @@ public:
     int nType;
     int nVersion;
 
-    typedef vector_type::allocator_type   allocator_type;
-    typedef vector_type::size_type        size_type;
-    typedef vector_type::difference_type  difference_type;
-    typedef vector_type::reference        reference;
-    typedef vector_type::const_reference  const_reference;
-    typedef vector_type::value_type       value_type;
-    typedef vector_type::iterator         iterator;
-    typedef vector_type::const_iterator   const_iterator;
-    typedef vector_type::reverse_iterator reverse_iterator;
-
-    explicit CDataStream(int nTypeIn=SER_NETWORK, int nVersionIn=PROTOCOL_VERSION)
+    typedef typename vector_type::allocator_type   allocator_type;
+    typedef typename vector_type::size_type        size_type;
+    typedef typename vector_type::difference_type  difference_type;
+    typedef typename vector_type::reference        reference;
+    typedef typename vector_type::const_reference  const_reference;
+    typedef typename vector_type::value_type       value_type;
+    typedef typename vector_type::iterator         iterator;
+    typedef typename vector_type::const_iterator   const_iterator;
+    typedef typename vector_type::reverse_iterator reverse_iterator;
+
+    explicit CBaseDataStream(int nTypeIn=SER_NETWORK, int nVersionIn=PROTOCOL_VERSION)
     {
         Init(nTypeIn, nVersionIn);
     }
 
-    CDataStream(const_iterator pbegin, const_iterator pend, int nTypeIn=SER_NETWORK, int nVersionIn=PROTOCOL_VERSION) : vch(pbegin, pend)
+    CBaseDataStream(const_iterator pbegin, const_iterator pend, int nTypeIn=SER_NETWORK, int nVersionIn=PROTOCOL_VERSION) : vch(pbegin, pend)
     {
         Init(nTypeIn, nVersionIn);
     }
 
 #if !defined(_MSC_VER) || _MSC_VER >= 1300
-    CDataStream(const char* pbegin, const char* pend, int nTypeIn=SER_NETWORK, int nVersionIn=PROTOCOL_VERSION) : vch(pbegin, pend)
+    CBaseDataStream(const char* pbegin, const char* pend, int nTypeIn=SER_NETWORK, int nVersionIn=PROTOCOL_VERSION) : vch(pbegin, pend)
     {
         Init(nTypeIn, nVersionIn);
     }
 #endif
 
-    CDataStream(const vector_type& vchIn, int nTypeIn=SER_NETWORK, int nVersionIn=PROTOCOL_VERSION) : vch(vchIn.begin(), vchIn.end())
+    CBaseDataStream(const vector_type& vchIn, int nTypeIn=SER_NETWORK, int nVersionIn=PROTOCOL_VERSION) : vch(vchIn.begin(), vchIn.end())
     {
         Init(nTypeIn, nVersionIn);
     }
 
-    CDataStream(const std::vector<char>& vchIn, int nTypeIn=SER_NETWORK, int nVersionIn=PROTOCOL_VERSION) : vch(vchIn.begin(), vchIn.end())
+    CBaseDataStream(const std::vector<char>& vchIn, int nTypeIn=SER_NETWORK, int nVersionIn=PROTOCOL_VERSION) : vch(vchIn.begin(), vchIn.end())
     {
         Init(nTypeIn, nVersionIn);
     }
 
-    CDataStream(const std::vector<unsigned char>& vchIn, int nTypeIn=SER_NETWORK, int nVersionIn=PROTOCOL_VERSION) : vch((char*)&vchIn.begin()[0], (char*)&vchIn.end()[0])
+    CBaseDataStream(const std::vector<unsigned char>& vchIn, int nTypeIn=SER_NETWORK, int nVersionIn=PROTOCOL_VERSION) : vch((char*)&vchIn.begin()[0], (char*)&vchIn.end()[0])
     {
         Init(nTypeIn, nVersionIn);
     }
@@ -896,15 +1013,15 @@ public:
         exceptmask = std::ios::badbit | std::ios::failbit;
     }
 
-    CDataStream& operator+=(const CDataStream& b)
+    CBaseDataStream& operator+=(const CBaseDataStream& b)
     {
         vch.insert(vch.end(), b.begin(), b.end());
         return *this;
     }
 
-    friend CDataStream operator+(const CDataStream& a, const CDataStream& b)
+    friend CBaseDataStream operator+(const CBaseDataStream& a, const CBaseDataStream& b)
     {
-        CDataStream ret = a;
+        CBaseDataStream ret = a;
         ret += b;
         return (ret);
     }
@@ -1027,7 +1144,7 @@ public:
     void clear(short n)          { state = n; }  // name conflict with vector clear()
     short exceptions()           { return exceptmask; }
     short exceptions(short mask) { short prev = exceptmask; exceptmask = mask; setstate(0, "CDataStream"); return prev; }
-    CDataStream* rdbuf()         { return this; }
+    CBaseDataStream* rdbuf()         { return this; }
     int in_avail()               { return size(); }
 
     void SetType(int n)          { nType = n; }
@@ -1037,7 +1154,7 @@ public:
     void ReadVersion()           { *this >> nVersion; }
     void WriteVersion()          { *this << nVersion; }
 
-    CDataStream& read(char* pch, int nSize)
+    CBaseDataStream& read(char* pch, int nSize)
     {
         // Read from the beginning of the buffer
         assert(nSize >= 0);
@@ -1060,7 +1177,7 @@ public:
         return (*this);
     }
 
-    CDataStream& ignore(int nSize)
+    CBaseDataStream& ignore(int nSize)
     {
         // Ignore from the beginning of the buffer
         assert(nSize >= 0);
@@ -1080,7 +1197,7 @@ public:
         return (*this);
     }
 
-    CDataStream& write(const char* pch, int nSize)
+    CBaseDataStream& write(const char* pch, int nSize)
     {
         // Write to the end of the buffer
         assert(nSize >= 0);
@@ -1104,7 +1221,7 @@ public:
     }
 
     template<typename T>
-    CDataStream& operator<<(const T& obj)
+    CBaseDataStream& operator<<(const T& obj)
     {
         // Serialize to this stream
         ::Serialize(*this, obj, nType, nVersion);
@@ -1112,7 +1229,7 @@ public:
     }
 
     template<typename T>
-    CDataStream& operator>>(T& obj)
+    CBaseDataStream& operator>>(T& obj)
     {
         // Unserialize from this stream
         ::Unserialize(*this, obj, nType, nVersion);
@@ -1120,6 +1237,77 @@ public:
     }
 };
 
+typedef CBaseDataStream<secure_allocator<char> > CDataStream;
+typedef CBaseDataStream<pool_allocator<char> > CNetDataStream;
+
+
+//
+// Read-only stream over memory owned by someone else, to deserialize in place
+// (e.g. a message inside a receive buffer) without copying it into a CDataStream.
+// The memory must outlive the view. Reading past the end throws.
+//
+class CDataView
+{
+protected:
+    const char* pbegin;
+    const char* pend;
+public:
+    int nType;
+    int nVersion;
+
+    CDataView(const char* pbeginIn, const char* pendIn, int nTypeIn=SER_NETWORK, int nVersionIn=PROTOCOL_VERSION) : pbegin(pbeginIn), pend(pendIn), nType(nTypeIn), nVersion(nVersionIn)
+    {
+    }
+
+    const char* begin() const    { return pbegin; }
+    const char* end() const      { return pend; }
+    unsigned int size() const    { return pend - pbegin; }
+    bool empty() const           { return pbegin == pend; }
+    bool eof() const             { return pbegin == pend; }
+
+    int GetType()                { return nType; }
+    int GetVersion()             { return nVersion; }
+
+    CDataView& read(char* pch, int nSize)
+    {
+        assert(nSize >= 0);
+        if (nSize > pend - pbegin)
+        {
+            memset(pch, 0, nSize);
+            pbegin = pend;
+            throw std::ios_base::failure("CDataView::read() : end of data");
+        }
+        memcpy(pch, pbegin, nSize);
+        pbegin += nSize;
+        return (*this);
+    }
+
+    CDataView& ignore(int nSize)
+    {
+        assert(nSize >= 0);
+        if (nSize > pend - pbegin)
+        {
+            pbegin = pend;
+            throw std::ios_base::failure("CDataView::ignore() : end of data");
+        }
+        pbegin += nSize;
+        return (*this);
+    }
+
+    template<typename T>
+    unsigned int GetSerializeSize(const T& obj)
+    {
+        return ::GetSerializeSize(obj, nType, nVersion);
+    }
+
+    template<typename T>
+    CDataView& operator>>(T& obj)
+    {
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
 #ifdef TESTCDATASTREAM
 // VC6sp6
 // CDataStream:
@@ -0,0 +1,161 @@
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <openssl/sha.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define USE_X86_KERNELS 1
+#endif
+
+#include "sha256.h"
+
+namespace {
+
+const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+const uint32_t INIT[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+inline uint32_t ReadBE32(const unsigned char* p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+inline void WriteBE32(unsigned char* p, uint32_t x)
+{
+    p[0] = x >> 24;
+    p[1] = x >> 16;
+    p[2] = x >> 8;
+    p[3] = x;
+}
+
+// Single SHA-256 of eight 32-byte inputs (in + 32*i) to out + 32*i.
+typedef void (*Hash32x8Fn)(unsigned char* out, const unsigned char* in);
+
+#ifdef USE_X86_KERNELS
+__attribute__((target("avx2"))) inline __m256i Add(__m256i x, __m256i y) { return _mm256_add_epi32(x, y); }
+__attribute__((target("avx2"))) inline __m256i Xor(__m256i x, __m256i y, __m256i z) { return _mm256_xor_si256(_mm256_xor_si256(x, y), z); }
+__attribute__((target("avx2"))) inline __m256i Ror(__m256i x, int n) { return _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - n)); }
+
+// Eight SHA-256 computations in parallel, one per 32-bit lane. A 32-byte
+// input always fits a single padded block, so most of the schedule is fixed.
+__attribute__((target("avx2")))
+void Hash32x8AVX2(unsigned char* out, const unsigned char* in)
+{
+    __m256i w[64];
+    for (int i = 0; i < 8; i++)
+        w[i] = _mm256_setr_epi32(ReadBE32(in + 4 * i), ReadBE32(in + 32 + 4 * i), ReadBE32(in + 64 + 4 * i), ReadBE32(in + 96 + 4 * i),
+                                 ReadBE32(in + 128 + 4 * i), ReadBE32(in + 160 + 4 * i), ReadBE32(in + 192 + 4 * i), ReadBE32(in + 224 + 4 * i));
+    w[8] = _mm256_set1_epi32(0x80000000);
+    for (int i = 9; i < 15; i++)
+        w[i] = _mm256_setzero_si256();
+    w[15] = _mm256_set1_epi32(256);
+    for (int i = 16; i < 64; i++)
+    {
+        __m256i s0 = Xor(Ror(w[i - 15], 7), Ror(w[i - 15], 18), _mm256_srli_epi32(w[i - 15], 3));
+        __m256i s1 = Xor(Ror(w[i - 2], 17), Ror(w[i - 2], 19), _mm256_srli_epi32(w[i - 2], 10));
+        w[i] = Add(Add(w[i - 16], s0), Add(w[i - 7], s1));
+    }
+
+    __m256i v[8];
+    for (int i = 0; i < 8; i++)
+        v[i] = _mm256_set1_epi32(INIT[i]);
+    __m256i a = v[0], b = v[1], c = v[2], d = v[3], e = v[4], f = v[5], g = v[6], h = v[7];
+    for (int i = 0; i < 64; i++)
+    {
+        __m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+        __m256i maj = _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(c, _mm256_or_si256(a, b)));
+        __m256i t1 = Add(Add(h, Xor(Ror(e, 6), Ror(e, 11), Ror(e, 25))), Add(Add(ch, _mm256_set1_epi32(K[i])), w[i]));
+        __m256i t2 = Add(Xor(Ror(a, 2), Ror(a, 13), Ror(a, 22)), maj);
+        h = g; g = f; f = e; e = Add(d, t1);
+        d = c; c = b; b = a; a = Add(t1, t2);
+    }
+    v[0] = Add(v[0], a); v[1] = Add(v[1], b); v[2] = Add(v[2], c); v[3] = Add(v[3], d);
+    v[4] = Add(v[4], e); v[5] = Add(v[5], f); v[6] = Add(v[6], g); v[7] = Add(v[7], h);
+
+    for (int i = 0; i < 8; i++)
+    {
+        uint32_t lanes[8];
+        _mm256_storeu_si256((__m256i*)lanes, v[i]);
+        for (int j = 0; j < 8; j++)
+            WriteBE32(out + 32 * j + 4 * i, lanes[j]);
+    }
+}
+#endif
+
+struct CKernels
+{
+    Hash32x8Fn hash32x8; // NULL if there is no multi-buffer kernel
+    std::string strName;
+
+    CKernels() : hash32x8(NULL), strName("openssl")
+    {
+#ifdef USE_X86_KERNELS
+        uint32_t eax, ebx, ecx, edx;
+        bool fYMM = false, fAVX2 = false;
+        if (__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        {
+            // AVX registers are only usable if the OS saves them (OSXSAVE + XCR0)
+            if (((ecx >> 27) & 1) && ((ecx >> 28) & 1))
+            {
+                uint32_t xcr0, xcr0hi;
+                __asm__("xgetbv" : "=a"(xcr0), "=d"(xcr0hi) : "c"(0));
+                fYMM = (xcr0 & 6) == 6;
+            }
+        }
+        if (__get_cpuid_max(0, NULL) >= 7)
+        {
+            __cpuid_count(7, 0, eax, ebx, ecx, edx);
+            fAVX2 = (ebx >> 5) & 1;
+        }
+        if (fAVX2 && fYMM)
+        {
+            hash32x8 = Hash32x8AVX2;
+            strName += ",avx2";
+        }
+#endif
+    }
+};
+
+const CKernels& Kernels()
+{
+    static const CKernels kernels;
+    return kernels;
+}
+
+}
+
+void SHA256DBatch(unsigned char* pout, const unsigned char* const* ppch, const size_t* pnLen, size_t nCount)
+{
+    const CKernels& kernels = Kernels();
+    // The first round runs over whole payloads, which OpenSSL's own
+    // (SHA-NI or assembly) code does best, one buffer at a time.
+    for (size_t i = 0; i < nCount; i++)
+        SHA256(ppch[i], pnLen[i], pout + 32 * i);
+    size_t i = 0;
+    if (kernels.hash32x8)
+        for (; i + 8 <= nCount; i += 8)
+            kernels.hash32x8(pout + 32 * i, pout + 32 * i);
+    unsigned char hash[32];
+    for (; i < nCount; i++) {
+        SHA256(pout + 32 * i, 32, hash);
+        memcpy(pout + 32 * i, hash, 32);
+    }
+}
+
+const char* SHA256DImplementation()
+{
+    return Kernels().strName.c_str();
+}
@@ -0,0 +1,14 @@
+#ifndef BITCOIN_SHA256_H
+#define BITCOIN_SHA256_H
+
+#include <stddef.h>
+
+/** Double SHA-256 of nCount buffers at once, with results written to
+ *  pout + 32*i. Batching lets the second round use a multi-buffer kernel.
+ */
+void SHA256DBatch(unsigned char* pout, const unsigned char* const* ppch, const size_t* pnLen, size_t nCount);
+
+/** Name of the kernels chosen for this CPU, e.g. "openssl,avx2". */
+const char* SHA256DImplementation();
+
+#endif
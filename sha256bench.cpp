@@ -0,0 +1,59 @@
+// Compares SHA256DBatch against hashing each message with Hash(), the
+// OpenSSL-only path, on the message sizes a crawler sees.
+//
+//   $ make sha256bench && ./sha256bench
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "sha256.h"
+#include "util.h"
+
+static int64 TimeHash(const std::vector<unsigned char>& vData, size_t nLen, size_t nBatch, int nRounds, std::vector<unsigned char>& vOut)
+{
+    int64 nStart = GetTimeMillis();
+    for (int r = 0; r < nRounds; r++)
+        for (size_t i = 0; i < nBatch; i++) {
+            uint256 hash = Hash(vData.begin() + i * nLen, vData.begin() + (i + 1) * nLen);
+            memcpy(&vOut[32 * i], &hash, 32);
+        }
+    return GetTimeMillis() - nStart;
+}
+
+static int64 TimeBatch(const std::vector<unsigned char>& vData, size_t nLen, size_t nBatch, int nRounds, std::vector<unsigned char>& vOut)
+{
+    std::vector<const unsigned char*> vpch(nBatch);
+    std::vector<size_t> vnLen(nBatch, nLen);
+    for (size_t i = 0; i < nBatch; i++)
+        vpch[i] = &vData[i * nLen];
+    int64 nStart = GetTimeMillis();
+    for (int r = 0; r < nRounds; r++)
+        SHA256DBatch(&vOut[0], &vpch[0], &vnLen[0], nBatch);
+    return GetTimeMillis() - nStart;
+}
+
+int main()
+{
+    // ping/pong, a 10-entry addr, a full addr, and a 30 KB payload
+    static const size_t vnLen[] = {8, 301, 30003, 30000};
+    static const size_t vnBatch[] = {16, 16, 16, 1};
+    printf("Using %s sha256d\n", SHA256DImplementation());
+    printf("%8s %6s %10s %10s %10s\n", "bytes", "batch", "hashes", "Hash() ms", "batch ms");
+    for (int n = 0; n < sizeof(vnLen) / sizeof(vnLen[0]); n++) {
+        size_t nLen = vnLen[n], nBatch = vnBatch[n];
+        int nRounds = 600000000 / (nBatch * (nLen + 400));
+        std::vector<unsigned char> vData(nLen * nBatch);
+        for (size_t i = 0; i < vData.size(); i++)
+            vData[i] = i * 131 + (i >> 8);
+        std::vector<unsigned char> vHash(32 * nBatch), vBatch(32 * nBatch);
+        int64 nHash = TimeHash(vData, nLen, nBatch, nRounds, vHash);
+        int64 nBatchTime = TimeBatch(vData, nLen, nBatch, nRounds, vBatch);
+        if (vHash != vBatch) {
+            printf("MISMATCH for %i-byte messages\n", (int)nLen);
+            return 1;
+        }
+        printf("%8i %6i %10i %10i %10i\n", (int)nLen, (int)nBatch, (int)(nRounds * nBatch), (int)nHash, (int)nBatchTime);
+    }
+    return 0;
+}
@@ -0,0 +1,49 @@
+#include "siphash.h"
+
+static inline uint64_t Rotl(uint64_t x, int b) { return (x << b) | (x >> (64 - b)); }
+
+static inline uint64_t ReadLE64(const unsigned char *pch) {
+  uint64_t x = 0;
+  for (int i = 7; i >= 0; i--)
+    x = (x << 8) | pch[i];
+  return x;
+}
+
+#define SIPROUND do { \
+  v0 += v1; v1 = Rotl(v1, 13); v1 ^= v0; v0 = Rotl(v0, 32); \
+  v2 += v3; v3 = Rotl(v3, 16); v3 ^= v2; \
+  v0 += v3; v3 = Rotl(v3, 21); v3 ^= v0; \
+  v2 += v1; v1 = Rotl(v1, 17); v1 ^= v2; v2 = Rotl(v2, 32); \
+} while (0)
+
+uint64_t SipHash(uint64_t k0, uint64_t k1, const unsigned char *pch, size_t nLen) {
+  uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+  uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+  uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+  uint64_t v3 = 0x7465646279746573ULL ^ k1;
+
+  const unsigned char *pend = pch + (nLen & ~(size_t)7);
+  for (; pch < pend; pch += 8) {
+    uint64_t m = ReadLE64(pch);
+    v3 ^= m;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= m;
+  }
+
+  // the last 0-7 bytes, with the length in the top byte
+  uint64_t b = (uint64_t)nLen << 56;
+  for (int i = (nLen & 7) - 1; i >= 0; i--)
+    b |= (uint64_t)pch[i] << (8 * i);
+  v3 ^= b;
+  SIPROUND;
+  SIPROUND;
+  v0 ^= b;
+
+  v2 ^= 0xff;
+  SIPROUND;
+  SIPROUND;
+  SIPROUND;
+  SIPROUND;
+  return v0 ^ v1 ^ v2 ^ v3;
+}
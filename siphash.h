@@ -0,0 +1,12 @@
+#ifndef _SIPHASH_H_
+#define _SIPHASH_H_ 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+// SipHash-2-4 of nLen bytes at pch, under the 128-bit key (k0, k1). A fast
+// keyed hash for tables whose keys come from the network: without the key,
+// nobody can pick inputs that collide.
+uint64_t SipHash(uint64_t k0, uint64_t k1, const unsigned char *pch, size_t nLen);
+
+#endif
@@ -0,0 +1,165 @@
+#ifndef _SLOTMAP_H_
+#define _SLOTMAP_H_ 1
+
+#include <assert.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <vector>
+
+#define SLOT_INDEX_BITS 24
+
+// the slot an id from a CSlotMap is stored in
+static inline int GetSlotIndex(int id) { return id & ((1 << SLOT_INDEX_BITS) - 1); }
+
+// Values stored contiguously by id, with the slots of erased values reused.
+// An id is a slot index in the low SLOT_INDEX_BITS bits, and the generation
+// of the slot in the bits above. The generation changes on every erase, so
+// an old id does not find the value that took over its slot, unless the
+// slot was reused a multiple of 128 times since (the generation has 7 bits
+// and wraps). It is a safety net only: CAddrDb does not keep ids past
+// their value's erase. Lookups are a bounds check and an array access.
+template <typename T>
+class CSlotMap {
+public:
+  static const int MAX_SLOTS = 1 << SLOT_INDEX_BITS;
+
+private:
+  static const int GENERATION_MASK = (1 << (31 - SLOT_INDEX_BITS)) - 1;
+
+  struct CSlot {
+    T value;
+    int nGeneration;
+    bool fUsed;
+  };
+
+  std::vector<CSlot> vSlot;
+  std::vector<int> vFree; // indexes of unused slots
+  size_t nCount;
+
+  static int GetIndex(int id) { return GetSlotIndex(id); }
+  static int MakeId(int nIndex, int nGeneration) { return (nGeneration << SLOT_INDEX_BITS) | nIndex; }
+
+public:
+  CSlotMap() : nCount(0) {}
+
+  size_t size() const { return nCount; }
+  bool empty() const { return nCount == 0; }
+
+  // slots in use and not, for iterating with GetId
+  size_t capacity() const { return vSlot.size(); }
+
+  // the id of the value in slot nIndex, or -1 if it is unused
+  int GetId(size_t nIndex) const {
+    const CSlot &slot = vSlot[nIndex];
+    return slot.fUsed ? MakeId(nIndex, slot.nGeneration) : -1;
+  }
+
+  bool count(int id) const {
+    if (id < 0 || GetIndex(id) >= vSlot.size()) return false;
+    const CSlot &slot = vSlot[GetIndex(id)];
+    return slot.fUsed && MakeId(GetIndex(id), slot.nGeneration) == id;
+  }
+
+  // store value, and return its id; -1 if all MAX_SLOTS are taken
+  int insert(const T &value) {
+    int nIndex;
+    if (!vFree.empty()) {
+      nIndex = vFree.back();
+      vFree.pop_back();
+    } else {
+      if (vSlot.size() >= MAX_SLOTS) return -1;
+      nIndex = vSlot.size();
+      CSlot slot = {T(), 0, false};
+      vSlot.push_back(slot);
+    }
+    CSlot &slot = vSlot[nIndex];
+    slot.value = value;
+    slot.fUsed = true;
+    nCount++;
+    return MakeId(nIndex, slot.nGeneration);
+  }
+
+  void erase(int id) {
+    if (!count(id)) return;
+    CSlot &slot = vSlot[GetIndex(id)];
+    slot.value = T();
+    slot.fUsed = false;
+    slot.nGeneration = (slot.nGeneration + 1) & GENERATION_MASK;
+    vFree.push_back(GetIndex(id));
+    nCount--;
+  }
+
+  void clear() {
+    vSlot.clear();
+    vFree.clear();
+    nCount = 0;
+  }
+
+  // id must be in the map
+  T &operator[](int id) {
+    assert(count(id));
+    return vSlot[GetIndex(id)].value;
+  }
+  const T &operator[](int id) const {
+    assert(count(id));
+    return vSlot[GetIndex(id)].value;
+  }
+
+  // the value for id, or NULL
+  T *find(int id) { return count(id) ? &vSlot[GetIndex(id)].value : NULL; }
+  const T *find(int id) const { return count(id) ? &vSlot[GetIndex(id)].value : NULL; }
+};
+
+// A set of ids from a CSlotMap, kept densely in a vector so that one can be
+// picked at random; the position of each id in it is looked up by slot.
+// Erasing moves the last id into the hole. Everything is constant time.
+class CSlotIdSet {
+private:
+  std::vector<int> vId;
+  std::vector<int> vPos; // by slot; only meaningful where vId agrees
+
+public:
+  typedef std::vector<int>::const_iterator const_iterator;
+
+  size_t size() const { return vId.size(); }
+  bool empty() const { return vId.empty(); }
+  const_iterator begin() const { return vId.begin(); }
+  const_iterator end() const { return vId.end(); }
+  int operator[](size_t nPos) const { return vId[nPos]; }
+
+  bool count(int id) const {
+    int nSlot = GetSlotIndex(id);
+    return nSlot < vPos.size() && vPos[nSlot] < vId.size() && vId[vPos[nSlot]] == id;
+  }
+
+  bool insert(int id) {
+    if (count(id)) return false;
+    int nSlot = GetSlotIndex(id);
+    if (nSlot >= vPos.size())
+      vPos.resize(std::max((size_t)nSlot + 1, vPos.size() * 2));
+    vPos[nSlot] = vId.size();
+    vId.push_back(id);
+    return true;
+  }
+
+  bool erase(int id) {
+    if (!count(id)) return false;
+    int nPos = vPos[GetSlotIndex(id)];
+    int nLast = vId.back();
+    vId[nPos] = nLast;
+    vPos[GetSlotIndex(nLast)] = nPos;
+    vId.pop_back();
+    return true;
+  }
+
+  void clear() {
+    vId.clear();
+    vPos.clear();
+  }
+
+  // a uniformly random id; the set must not be empty
+  int GetRandom() const { return vId[rand() % vId.size()]; }
+};
+
+#endif
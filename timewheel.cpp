@@ -0,0 +1,133 @@
+#include <algorithm>
+
+#include "timewheel.h"
+
+using namespace std;
+
+CTimingWheel::CTimingWheel() : nTime(time(NULL)), nEntries(0) {}
+
+bool CTimingWheel::IsLive(const CEntry &entry) const {
+  return setId.count(entry.id) && vnDue[GetSlotIndex(entry.id)] == entry.nDue;
+}
+
+void CTimingWheel::Place(const CEntry &entry) {
+  nEntries++;
+  if (entry.nDue < nTime) {
+    vDue.push_back(entry);
+    return;
+  }
+  int64 nDelta = entry.nDue - nTime;
+  int nLevel = 0;
+  while (nLevel < LEVELS - 1 && nDelta >= (1LL << (SLOT_BITS * (nLevel + 1))))
+    nLevel++;
+  vSlot[nLevel][(entry.nDue >> (SLOT_BITS * nLevel)) & (SLOTS - 1)].push_back(entry);
+}
+
+void CTimingWheel::Advance(int64 now) {
+  while (nTime <= now) {
+    // move the slots that start now down a level, coarsest first
+    for (int nLevel = LEVELS - 1; nLevel > 0; nLevel--) {
+      if (nTime & ((1LL << (SLOT_BITS * nLevel)) - 1)) continue;
+      vector<CEntry> vMove;
+      vMove.swap(vSlot[nLevel][(nTime >> (SLOT_BITS * nLevel)) & (SLOTS - 1)]);
+      nEntries -= vMove.size();
+      for (int i = 0; i < vMove.size(); i++) {
+        if (IsLive(vMove[i]))
+          Place(vMove[i]);
+      }
+    }
+    vector<CEntry> &slot = vSlot[0][nTime & (SLOTS - 1)];
+    for (int i = 0; i < slot.size(); i++) {
+      if (IsLive(slot[i]))
+        vDue.push_back(slot[i]);
+      else
+        nEntries--;
+    }
+    slot.clear();
+    nTime++;
+  }
+}
+
+static bool CompareDue(const pair<int64, int> &a, const pair<int64, int> &b) {
+  return a.first < b.first;
+}
+
+// drop stale entries, once they outnumber the live ones
+void CTimingWheel::Compact() {
+  if (nEntries < 2 * setId.size() + 1024) return;
+  vector<pair<int64, int> > vLive;
+  vLive.reserve(setId.size());
+  for (CSlotIdSet::const_iterator it = setId.begin(); it != setId.end(); it++)
+    vLive.push_back(make_pair(vnDue[GetSlotIndex(*it)], *it));
+  stable_sort(vLive.begin(), vLive.end(), CompareDue);
+  for (int l = 0; l < LEVELS; l++)
+    for (int i = 0; i < SLOTS; i++)
+      vector<CEntry>().swap(vSlot[l][i]);
+  vDue.clear();
+  nEntries = 0;
+  for (int i = 0; i < vLive.size(); i++) {
+    CEntry entry = {vLive[i].second, vLive[i].first};
+    Place(entry);
+  }
+}
+
+void CTimingWheel::Schedule(int id, int64 nDue) {
+  int nSlot = GetSlotIndex(id);
+  if (nSlot >= vnDue.size())
+    vnDue.resize(max((size_t)nSlot + 1, vnDue.size() * 2));
+  vnDue[nSlot] = nDue;
+  setId.insert(id);
+  CEntry entry = {id, nDue};
+  Place(entry);
+  Compact();
+}
+
+void CTimingWheel::Remove(int id) {
+  setId.erase(id);
+}
+
+bool CTimingWheel::Pop(int64 now, int &id) {
+  Advance(now);
+  while (!vDue.empty()) {
+    CEntry entry = vDue.front();
+    vDue.pop_front();
+    nEntries--;
+    if (IsLive(entry)) {
+      setId.erase(entry.id);
+      id = entry.id;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool CTimingWheel::GetNext(int &id, int64 &nDue) const {
+  for (deque<CEntry>::const_iterator it = vDue.begin(); it != vDue.end(); it++) {
+    if (IsLive(*it)) {
+      id = it->id;
+      nDue = it->nDue;
+      return true;
+    }
+  }
+  bool fFound = false;
+  for (int l = 0; l < LEVELS; l++) {
+    // the current slot of a level may hold entries a whole turn ahead, so
+    // look on to the next slot with live entries as well
+    int nPos = (nTime >> (SLOT_BITS * l)) & (SLOTS - 1);
+    for (int i = 0; i < SLOTS; i++) {
+      const vector<CEntry> &slot = vSlot[l][(nPos + i) & (SLOTS - 1)];
+      bool fLive = false;
+      for (int j = 0; j < slot.size(); j++) {
+        if (!IsLive(slot[j])) continue;
+        fLive = true;
+        if (!fFound || slot[j].nDue < nDue) {
+          id = slot[j].id;
+          nDue = slot[j].nDue;
+          fFound = true;
+        }
+      }
+      if (fLive && i > 0) break;
+    }
+  }
+  return fFound;
+}
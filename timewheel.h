@@ -0,0 +1,63 @@
+#ifndef _TIMEWHEEL_H_
+#define _TIMEWHEEL_H_ 1
+
+#include <deque>
+#include <vector>
+
+#include "slotmap.h"
+#include "util.h"
+
+// Hierarchical timing wheel of ids, keyed by the second they are due. Four
+// levels of 256 slots hold entries due within 256s, 18h, 194 days and 136
+// years; an entry moves down a level each time its slot comes around, and
+// reaches the due queue in the second it is due. Scheduling and popping take
+// amortized constant time; GetNext looks through up to a turn of each level.
+//
+// Ids are CSlotMap ids, and their due times are kept in a vector by slot.
+// Rescheduling or removing an id does not search the wheel: its old entry
+// is left in place, and skipped as stale once it comes up.
+class CTimingWheel {
+private:
+  static const int SLOT_BITS = 8;
+  static const int SLOTS = 1 << SLOT_BITS;
+  static const int LEVELS = 4;
+
+  struct CEntry {
+    int id;
+    int64 nDue;
+  };
+
+  std::vector<CEntry> vSlot[LEVELS][SLOTS];
+  std::deque<CEntry> vDue;       // entries that are due, in the order they became due
+  CSlotIdSet setId;              // the ids scheduled
+  std::vector<int64> vnDue;      // by slot, when the id there is due; entries that disagree are stale
+  int64 nTime;                   // entries due before this are in vDue
+  size_t nEntries;               // live and stale entries in the wheel and vDue
+
+  bool IsLive(const CEntry &entry) const;
+  void Place(const CEntry &entry);
+  void Advance(int64 now);
+  void Compact();
+
+public:
+  CTimingWheel();
+
+  size_t size() const { return setId.size(); }
+  bool empty() const { return setId.empty(); }
+  bool count(int id) const { return setId.count(id); }
+
+  // (re)schedule id for nDue; ids due in the past go to the back of the due queue
+  void Schedule(int id, int64 nDue);
+  void Remove(int id);
+
+  // take the id that has been due the longest, if any is due at now
+  bool Pop(int64 now, int &id);
+
+  // the next id to come up and when it is due, without taking it
+  bool GetNext(int &id, int64 &nDue) const;
+
+  // all scheduled ids, in no particular order
+  const CSlotIdSet &GetIds() const { return setId; }
+};
+
+#endif
@@ -0,0 +1,108 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+CIoUring::CIoUring() : fd(-1), nToSubmit(0), pSqRing(MAP_FAILED), pCqRing(MAP_FAILED), nSqRingSize(0), nCqRingSize(0), sqes((struct io_uring_sqe*)MAP_FAILED), nSqesSize(0) {}
+
+CIoUring::~CIoUring() {
+  if (sqes != MAP_FAILED) munmap(sqes, nSqesSize);
+  if (pCqRing != MAP_FAILED && pCqRing != pSqRing) munmap(pCqRing, nCqRingSize);
+  if (pSqRing != MAP_FAILED) munmap(pSqRing, nSqRingSize);
+  if (fd >= 0) close(fd);
+}
+
+bool CIoUring::Init(unsigned int nEntries) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  fd = syscall(__NR_io_uring_setup, nEntries, &p);
+  if (fd < 0) return false;
+  // bounded waits need IORING_ENTER_EXT_ARG (Linux 5.11)
+  if (!(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_NODROP)) return false;
+  nSqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+  nCqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (nCqRingSize > nSqRingSize) nSqRingSize = nCqRingSize;
+    nCqRingSize = nSqRingSize;
+  }
+  pSqRing = mmap(0, nSqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (pSqRing == MAP_FAILED) return false;
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    pCqRing = pSqRing;
+  } else {
+    pCqRing = mmap(0, nCqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (pCqRing == MAP_FAILED) return false;
+  }
+  nSqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+  sqes = (struct io_uring_sqe*)mmap(0, nSqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) return false;
+  char *sq = (char*)pSqRing, *cq = (char*)pCqRing;
+  sqHead = (unsigned int*)(sq + p.sq_off.head);
+  sqTail = (unsigned int*)(sq + p.sq_off.tail);
+  sqMask = (unsigned int*)(sq + p.sq_off.ring_mask);
+  sqArray = (unsigned int*)(sq + p.sq_off.array);
+  cqHead = (unsigned int*)(cq + p.cq_off.head);
+  cqTail = (unsigned int*)(cq + p.cq_off.tail);
+  cqMask = (unsigned int*)(cq + p.cq_off.ring_mask);
+  cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+  return true;
+}
+
+struct io_uring_sqe *CIoUring::GetSqe() {
+  unsigned int tail = *sqTail;
+  if (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) > *sqMask) {
+    Submit(0);
+    if (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) > *sqMask) return NULL;
+  }
+  unsigned int idx = tail & *sqMask;
+  struct io_uring_sqe *sqe = &sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  sqArray[idx] = idx;
+  __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+  nToSubmit++;
+  return sqe;
+}
+
+void CIoUring::Reserve(unsigned int nCount) {
+  if (*sqTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) + nCount > *sqMask + 1)
+    Submit(0);
+}
+
+int CIoUring::Submit(int nMilliSec) {
+  struct __kernel_timespec ts;
+  ts.tv_sec = nMilliSec / 1000;
+  ts.tv_nsec = (nMilliSec % 1000) * 1000000LL;
+  struct io_uring_getevents_arg arg;
+  memset(&arg, 0, sizeof(arg));
+  arg.ts = (uint64_t)&ts;
+  unsigned int nFlags = IORING_ENTER_EXT_ARG;
+  unsigned int nWait = 0;
+  if (nMilliSec > 0 && PeekCqe() == NULL) {
+    nFlags |= IORING_ENTER_GETEVENTS;
+    nWait = 1;
+  }
+  int ret;
+  do {
+    ret = syscall(__NR_io_uring_enter, fd, nToSubmit, nWait, nFlags, &arg, sizeof(arg));
+  } while (ret < 0 && errno == EINTR);
+  if (ret > 0) nToSubmit -= ret;
+  if (ret < 0 && (errno == ETIME || errno == EBUSY)) {
+    // waiting timed out, or the completion queue is full; queued entries
+    // are submitted on the next call
+    ret = 0;
+  }
+  return ret;
+}
+
+struct io_uring_cqe *CIoUring::PeekCqe() {
+  unsigned int head = *cqHead;
+  if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) return NULL;
+  return &cqes[head & *cqMask];
+}
+
+void CIoUring::SeenCqe() {
+  __atomic_store_n(cqHead, *cqHead + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,43 @@
+#ifndef _URING_H_
+#define _URING_H_ 1
+
+#include <linux/io_uring.h>
+#include <stdint.h>
+
+// Minimal io_uring submission/completion ring, using the raw system calls.
+class CIoUring {
+private:
+  int fd;
+  unsigned int nToSubmit;
+  void *pSqRing;
+  void *pCqRing;
+  size_t nSqRingSize;
+  size_t nCqRingSize;
+  struct io_uring_sqe *sqes;
+  size_t nSqesSize;
+  unsigned int *sqHead, *sqTail, *sqMask, *sqArray;
+  unsigned int *cqHead, *cqTail, *cqMask;
+  struct io_uring_cqe *cqes;
+
+public:
+  CIoUring();
+  ~CIoUring();
+
+  // returns false if io_uring is unavailable (old kernel, or blocked)
+  bool Init(unsigned int nEntries);
+
+  // get a zeroed submission entry, flushing the queue if it is full
+  struct io_uring_sqe *GetSqe();
+
+  // flush the queue unless nCount entries are free, so linked entries are submitted together
+  void Reserve(unsigned int nCount);
+
+  // submit all queued entries in one call, and wait up to nMilliSec for a completion
+  int Submit(int nMilliSec);
+
+  // the oldest unconsumed completion, or NULL
+  struct io_uring_cqe *PeekCqe();
+  void SeenCqe();
+};
+
+#endif
@@ -5,6 +5,7 @@
 #include <errno.h>
 #include <openssl/sha.h>
 #include <stdarg.h>
+#include <sys/time.h>
 
 #include "uint256.h"
 
@@ -79,6 +80,11 @@ void static inline Sleep(int nMilliSec) {
     nanosleep(&wa, NULL);
 }
 
+int64 static inline GetTimeMillis() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (int64)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
 
 std::string vstrprintf(const std::string &format, va_list ap);
 